@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+#include "activity.h"
+
+static const char *const node_names[NUM_NODES] = {
+    [NODE_IR] = "ir",
+    [NODE_OPERAND1] = "operand1",
+    [NODE_OPERAND2] = "operand2",
+    [NODE_RESULT] = "result",
+    [NODE_REGFILE] = "regfile",
+    [NODE_BUS] = "bus",
+};
+
+// Counting is enabled by pointing this at a profile
+activity_t *yarvis_activity;
+
+void activity_attach(activity_t *activity, const mem_t *mem, const char *const *state_names,
+                     unsigned int num_states) {
+    assert(activity && mem);
+    CHECK(num_states <= ACTIVITY_MAX_STATES);
+    memset(activity, 0, sizeof(*activity));
+    activity->mem = mem;
+    activity->state_names = state_names;
+    activity->num_states = num_states;
+    activity->functions = calloc(mem->num_symtab + 1, sizeof(activity_bin_t));
+    CHECK(activity->functions);
+    activity->state = activity->states;
+    activity_locate(activity, mem->entry_point);
+}
+
+// Finds the bins and code range of the symbol containing `pc`. Code
+// outside any symbol shares the last bin and is looked up every cycle.
+void activity_locate(activity_t *activity, memaddr_t pc) {
+    const mem_t *mem = activity->mem;
+    const memsymbol_t *symbol = mem_symbol_at(mem, pc);
+    if (!symbol) {
+        activity->function = activity->functions + mem->num_symtab;
+        activity->start = activity->end = 0;
+        return;
+    }
+    activity->function = activity->functions + (symbol - mem->symtab);
+    activity->start = symbol->address;
+    if (symbol->size) {
+        activity->end = symbol->address + symbol->size;
+        return;
+    }
+    activity->end = 0; // up to the next symbol, or the end of the address space
+    for (const memsymbol_t *next = symbol + 1; next < mem->symtab + mem->num_symtab; next++) {
+        if (next->address > symbol->address) {
+            activity->end = next->address;
+            break;
+        }
+    }
+}
+
+static uint64_t activity_total(const activity_bin_t *bin) {
+    uint64_t total = 0;
+    for (unsigned int node = 0; node < NUM_NODES; node++) {
+        total += bin->toggles[node];
+    }
+    return total;
+}
+
+static void activity_row(const activity_bin_t *bin, FILE *fh) {
+    for (unsigned int node = 0; node < NUM_NODES; node++) {
+        fprintf(fh, " %10llu", (unsigned long long)bin->toggles[node]);
+    }
+    fprintf(fh, " %12llu", (unsigned long long)activity_total(bin));
+}
+
+// Prints the toggle counts per FSM state, then per symbol together with the
+// toggles per instruction, which serves as a relative energy per
+// instruction.
+void activity_report(const activity_t *activity, FILE *fh) {
+    const mem_t *mem = activity->mem;
+    fprintf(fh, "%-24s %12s", "state", "cycles");
+    for (unsigned int node = 0; node < NUM_NODES; node++) {
+        fprintf(fh, " %10s", node_names[node]);
+    }
+    fprintf(fh, " %12s\n", "total");
+    for (unsigned int state = 0; state < activity->num_states; state++) {
+        const activity_bin_t *bin = activity->states + state;
+        fprintf(fh, "%-24s %12llu", activity->state_names[state], (unsigned long long)bin->cycles);
+        activity_row(bin, fh);
+        fprintf(fh, "\n");
+    }
+
+    fprintf(fh, "\n%-24s %12s %12s", "function", "instructions", "cycles");
+    for (unsigned int node = 0; node < NUM_NODES; node++) {
+        fprintf(fh, " %10s", node_names[node]);
+    }
+    fprintf(fh, " %12s %10s\n", "total", "per_instr");
+    for (unsigned int i = 0; i <= mem->num_symtab; i++) {
+        const activity_bin_t *bin = activity->functions + i;
+        if (!bin->cycles) {
+            continue;
+        }
+        fprintf(fh, "%-24s %12llu %12llu", (i < mem->num_symtab) ? mem->symtab[i].name : "(unknown)",
+                (unsigned long long)bin->instructions, (unsigned long long)bin->cycles);
+        activity_row(bin, fh);
+        fprintf(fh, " %10.2f\n", bin->instructions ? (double)activity_total(bin) / bin->instructions : 0.0);
+    }
+}
+
+void activity_destroy(activity_t *activity) {
+    assert(activity);
+    free(activity->functions);
+    activity->functions = NULL;
+}
@@ -0,0 +1,88 @@
+#ifndef _activity_h_
+#define _activity_h_
+
+// Switching activity: the number of bits that toggle on the key datapath
+// nodes, as a relative measure of dynamic power. Only counted in builds with
+// ACTIVITY=1, and only while yarvis_activity points at a profile.
+
+typedef enum {
+    NODE_IR,
+    NODE_OPERAND1,
+    NODE_OPERAND2,
+    NODE_RESULT,  // ALU output
+    NODE_REGFILE, // register file write data
+    NODE_BUS,     // memory address and data
+    NUM_NODES,
+} activity_node_t;
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t toggles[NUM_NODES];
+} activity_bin_t;
+
+#define ACTIVITY_MAX_STATES 8
+
+typedef struct {
+    const mem_t *mem;
+    unsigned int num_states;
+    const char *const *state_names;
+    activity_bin_t states[ACTIVITY_MAX_STATES];
+    activity_bin_t *functions;  // indexed like mem->symtab, then code outside any symbol
+    activity_bin_t *state;      // bins of the current cycle
+    activity_bin_t *function;
+    memaddr_t start, end;       // code range binned to `function`
+    memword_t nodes[NUM_NODES]; // previous value of each node
+    memaddr_t bus_address;
+} activity_t;
+
+extern activity_t *yarvis_activity;
+
+void activity_attach(activity_t *activity, const mem_t *mem, const char *const *state_names,
+                     unsigned int num_states);
+void activity_locate(activity_t *activity, memaddr_t pc);
+void activity_report(const activity_t *activity, FILE *fh);
+void activity_destroy(activity_t *activity);
+
+static inline void activity_toggle(activity_t *activity, activity_node_t node, memword_t value) {
+    unsigned int toggles = __builtin_popcountll(activity->nodes[node] ^ value);
+    activity->nodes[node] = value;
+    activity->state->toggles[node] += toggles;
+    activity->function->toggles[node] += toggles;
+}
+
+// Starts a cycle of the model in `state` at `pc`: bins it, then samples the
+// nodes that every cycle drives.
+static inline void activity_cycle(activity_t *activity, unsigned int state, memaddr_t pc,
+                                  memword_t ir, memword_t operand1, memword_t operand2, memword_t result) {
+    if (pc - activity->start >= activity->end - activity->start) {
+        activity_locate(activity, pc);
+    }
+    activity->state = activity->states + state;
+    activity->state->cycles++;
+    activity->function->cycles++;
+    activity_toggle(activity, NODE_IR, ir);
+    activity_toggle(activity, NODE_OPERAND1, operand1);
+    activity_toggle(activity, NODE_OPERAND2, operand2);
+    activity_toggle(activity, NODE_RESULT, result);
+}
+
+static inline void activity_bus(activity_t *activity, memaddr_t address, memword_t data) {
+    unsigned int toggles = __builtin_popcountll(activity->bus_address ^ address);
+    activity->bus_address = address;
+    activity->state->toggles[NODE_BUS] += toggles;
+    activity->function->toggles[NODE_BUS] += toggles;
+    activity_toggle(activity, NODE_BUS, data);
+}
+
+static inline void activity_regfile(activity_t *activity, unsigned int rd, memword_t value) {
+    if (rd) {
+        activity_toggle(activity, NODE_REGFILE, value);
+    }
+}
+
+static inline void activity_retire(activity_t *activity) {
+    activity->function->instructions++;
+}
+
+#endif // _activity_h_
@@ -0,0 +1,531 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "mem.h"
+#include "aot.h"
+#include "riscv.h"
+#include "rvc.h"
+
+// Ahead-of-time translation of guest text into a host shared object.
+//
+// Every executable PT_LOAD region is swept linearly and decoded. Block
+// leaders are the entry point, the start of each region, every direct
+// branch or jump target and every instruction following a control transfer
+// or an instruction that is left to the interpreter. From each leader a
+// block runs to the next control transfer, so blocks may overlap.
+//
+// Blocks only ever touch RAM through the page tables. An access that would
+// need the slow path (a device, a misaligned or an illegal address) leaves
+// the block just before that instruction, and the interpreter executes it
+// with exact timing. So do CSR accesses, ECALL/EBREAK, MRET and WFI, which
+// are never translated. Cycles are charged with the costs of the model the
+// simulator was built with, and main() only enters a block when it is
+// known to finish before the next timer interrupt and the cycle limit.
+
+#define AOT_MAX_BLOCK 128
+
+// Provided by the model, yarvis.c or yarvis_multicycle.c
+extern const unsigned int yarvis_cycles_per_instruction;
+extern const unsigned int yarvis_cycles_per_taken_branch;
+extern bool yarvis_fetching(void);
+
+static const char aot_preamble[] =
+    "#include <stdint.h>\n"
+    "typedef struct {\n"
+    "    uint32_t *regs;\n"
+    "    uint8_t *const *pages;\n"
+    "    uint8_t *const *write_pages;\n"
+    "    uint32_t tohost;\n"
+    "    uint32_t pc;\n"
+    "    unsigned long cycles;\n"
+    "    uint64_t instret;\n"
+    "    uint64_t parcels;\n"
+    "} aot_context_t;\n"
+    "typedef void aot_block_fn_t(aot_context_t *context);\n"
+    "typedef struct {\n"
+    "    uint32_t pc;\n"
+    "    unsigned int max_cycles;\n"
+    "    unsigned int last_fetch;\n"
+    "    aot_block_fn_t *fn;\n"
+    "} aot_block_t;\n"
+    "#define EXIT(next, n, k, f) do { \\\n"
+    "    c->pc = (next); c->cycles += (n); c->instret += (k); c->parcels += (f); return; \\\n"
+    "} while (0)\n"
+    "static inline uint8_t *translate(uint8_t *const *pages, uint32_t a, uint32_t size) {\n"
+    "    uint8_t *page = pages[a >> PAGE_SHIFT];\n"
+    "    return (page && !(a & (size - 1))) ? page + (a & ((1u << PAGE_SHIFT) - 1)) : 0;\n"
+    "}\n";
+
+static memword_t aot_imm(instruction_t ir) {
+    memword_t sign = (ir.raw & (1u << 31)) ? ~(memword_t)0 : 0;
+    switch (ir.r.opcode) {
+        case OP_STORE:
+            return ir.s.imm4_0 | (ir.s.imm11_5 << 5) | (sign << 12);
+        case OP_BRANCH:
+            return (ir.b.imm4_1 << 1) | (ir.b.imm10_5 << 5) | (ir.b.imm11 << 11) | (sign << 12);
+        case OP_LUI:
+        case OP_AUIPC:
+            return ir.u.imm31_12 << 12;
+        case OP_JAL:
+            return (ir.j.imm10_1 << 1) | (ir.j.imm11 << 11) | (ir.j.imm19_12 << 12) | (sign << 20);
+        default:
+            return ir.i.imm11_0 | (sign << 12);
+    }
+}
+
+// Mirrors the legality checks of the interpreters; anything rejected here
+// is left to them, so illegal instructions are still diagnosed there.
+static bool aot_translatable(instruction_t ir) {
+    bool uses_rs2 = false;
+    if (ir.r.quadrant != 3) {
+        return false;
+    }
+    switch (ir.r.opcode) {
+        case OP_OP:
+            uses_rs2 = true;
+            if ((ir.r.funct3 == F3_ADD_SUB) || (ir.r.funct3 == F3_SRL_SRA)) {
+                if (ir.r.funct7 & 0x5f) {
+                    return false;
+                }
+            } else if (ir.r.funct7) {
+                return false;
+            }
+            break;
+        case OP_OPIMM:
+            if ((ir.r.funct3 == F3_SLL) && ir.r.funct7) {
+                return false;
+            }
+            if ((ir.r.funct3 == F3_SRL_SRA) && (ir.r.funct7 & 0x5f)) {
+                return false;
+            }
+            break;
+        case OP_LOAD:
+            if ((ir.i.funct3 == 3) || (ir.i.funct3 > F3_HWORDU)) {
+                return false;
+            }
+            break;
+        case OP_STORE:
+            uses_rs2 = true;
+            if (ir.s.funct3 > F3_WORD) {
+                return false;
+            }
+            break;
+        case OP_BRANCH:
+            uses_rs2 = true;
+            if ((ir.b.funct3 == 2) || (ir.b.funct3 == 3)) {
+                return false;
+            }
+            break;
+        case OP_JALR:
+            if (ir.i.funct3 != F3_JALR) {
+                return false;
+            }
+            break;
+        case OP_MISCMEM:
+            if ((ir.i.funct3 != F3_FENCE) && (ir.i.funct3 != F3_FENCEI)) {
+                return false;
+            }
+            break;
+        case OP_LUI:
+        case OP_AUIPC:
+        case OP_JAL:
+            return ir.r.rd < NUM_REGS;
+        default:
+            return false;
+    }
+    return (ir.r.rd < NUM_REGS) && (ir.r.rs1 < NUM_REGS) && (!uses_rs2 || (ir.r.rs2 < NUM_REGS));
+}
+
+// Decodes the instruction at `pc`, expanding compressed ones. Returns its
+// length in bytes, or 0 if it runs off the end of the region.
+static unsigned int aot_decode(const mem_t *mem, const memregion_t *region, memaddr_t pc, instruction_t *ir) {
+    uint16_t parcel = mem_peek(mem, pc, 2);
+    if (RVC_IS_COMPRESSED(parcel)) {
+        ir->raw = rvc_expand(parcel);
+        return 2;
+    }
+    if (pc + 4 - region->address > region->size) {
+        return 0;
+    }
+    ir->raw = parcel | (uint32_t)mem_peek(mem, pc + 2, 2) << 16;
+    return 4;
+}
+
+static bool aot_is_transfer(instruction_t ir) {
+    return (ir.r.opcode == OP_JAL) || (ir.r.opcode == OP_JALR) || (ir.r.opcode == OP_BRANCH);
+}
+
+// Emits the C statements for one instruction of `length` bytes. `n`, `k`
+// and `f` are the cycles, instructions and fetched parcels completed in the
+// block before it.
+static void aot_emit(FILE *out, instruction_t ir, memaddr_t pc, unsigned int length, unsigned int n,
+                     unsigned int k, unsigned int f) {
+    static const char *const alu[] = {
+        [F3_ADD_SUB] = "+", [F3_XOR] = "^", [F3_OR] = "|", [F3_AND] = "&",
+    };
+    static const char *const cond[] = {
+        [F3_BEQ] = "a == b", [F3_BNE] = "a != b",
+        [F3_BLT] = "(int32_t)a < (int32_t)b", [F3_BGE] = "(int32_t)a >= (int32_t)b",
+        [F3_BLTU] = "a < b", [F3_BGEU] = "a >= b",
+    };
+    static const char *const load[] = {
+        [F3_BYTE] = "(uint32_t)*(int8_t *)p", [F3_HWORD] = "(uint32_t)*(int16_t *)p",
+        [F3_WORD] = "*(uint32_t *)p", [F3_BYTEU] = "*p", [F3_HWORDU] = "*(uint16_t *)p",
+    };
+    static const char *const store[] = {
+        [F3_BYTE] = "*p = (uint8_t)", [F3_HWORD] = "*(uint16_t *)p = (uint16_t)",
+        [F3_WORD] = "*(uint32_t *)p = ",
+    };
+    unsigned int cpi = yarvis_cycles_per_instruction;
+    memword_t imm = aot_imm(ir);
+    char operand2[32];
+    unsigned int rd = ir.r.rd;
+    memaddr_t next = pc + length;
+    unsigned int g = f + length / 2;
+
+    fprintf(out, "    // %08x: %08x%s\n", pc, ir.raw, (length == 2) ? " (compressed)" : "");
+    switch (ir.r.opcode) {
+        case OP_OP:
+        case OP_OPIMM:
+            if (!rd) {
+                break;
+            }
+            if (ir.r.opcode == OP_OP) {
+                snprintf(operand2, sizeof(operand2), "x[%u]", ir.r.rs2);
+            } else {
+                snprintf(operand2, sizeof(operand2), "0x%08xu", imm);
+            }
+            switch (ir.r.funct3) {
+                case F3_ADD_SUB:
+                    fprintf(out, "    x[%u] = x[%u] %s %s;\n", rd, ir.r.rs1,
+                            ((ir.r.opcode == OP_OP) && (ir.r.funct7 & 0x20)) ? "-" : "+", operand2);
+                    break;
+                case F3_SLT:
+                    fprintf(out, "    x[%u] = (int32_t)x[%u] < (int32_t)%s;\n", rd, ir.r.rs1, operand2);
+                    break;
+                case F3_SLTU:
+                    fprintf(out, "    x[%u] = x[%u] < %s;\n", rd, ir.r.rs1, operand2);
+                    break;
+                case F3_SLL:
+                    fprintf(out, "    x[%u] = x[%u] << (%s & 31);\n", rd, ir.r.rs1, operand2);
+                    break;
+                case F3_SRL_SRA:
+                    if (ir.r.funct7 & 0x20) {
+                        fprintf(out, "    x[%u] = (uint32_t)((int32_t)x[%u] >> (%s & 31));\n",
+                                rd, ir.r.rs1, operand2);
+                    } else {
+                        fprintf(out, "    x[%u] = x[%u] >> (%s & 31);\n", rd, ir.r.rs1, operand2);
+                    }
+                    break;
+                default:
+                    fprintf(out, "    x[%u] = x[%u] %s %s;\n", rd, ir.r.rs1, alu[ir.r.funct3], operand2);
+                    break;
+            }
+            break;
+        case OP_LUI:
+            if (rd) {
+                fprintf(out, "    x[%u] = 0x%08xu;\n", rd, imm);
+            }
+            break;
+        case OP_AUIPC:
+            if (rd) {
+                fprintf(out, "    x[%u] = 0x%08xu;\n", rd, pc + imm);
+            }
+            break;
+        case OP_JAL:
+            if (rd) {
+                fprintf(out, "    x[%u] = 0x%08xu;\n", rd, next);
+            }
+            fprintf(out, "    EXIT(0x%08xu, %u, %u, %u);\n", pc + imm, n + cpi, k + 1, g);
+            break;
+        case OP_JALR:
+            fprintf(out, "    { uint32_t t = (x[%u] + 0x%08xu) & ~1u;\n", ir.i.rs1, imm);
+            if (rd) {
+                fprintf(out, "      x[%u] = 0x%08xu;\n", rd, next);
+            }
+            fprintf(out, "      EXIT(t, %u, %u, %u); }\n", n + cpi, k + 1, g);
+            break;
+        case OP_BRANCH:
+            fprintf(out, "    { uint32_t a = x[%u], b = x[%u];\n", ir.b.rs1, ir.b.rs2);
+            fprintf(out, "      if (%s) EXIT(0x%08xu, %u, %u, %u);\n", cond[ir.b.funct3], pc + imm,
+                    n + cpi + yarvis_cycles_per_taken_branch, k + 1, g);
+            fprintf(out, "      EXIT(0x%08xu, %u, %u, %u); }\n", next, n + cpi, k + 1, g);
+            break;
+        case OP_LOAD:
+            fprintf(out, "    { uint8_t *p = translate(c->pages, x[%u] + 0x%08xu, %u);\n",
+                    ir.i.rs1, imm, 1 << (ir.i.funct3 & 3));
+            fprintf(out, "      if (!p) EXIT(0x%08xu, %u, %u, %u);\n", pc, n, k, f);
+            if (rd) {
+                fprintf(out, "      x[%u] = %s;", rd, load[ir.i.funct3]);
+            }
+            fprintf(out, " }\n");
+            break;
+        case OP_STORE:
+            fprintf(out, "    { uint32_t a = x[%u] + 0x%08xu;\n", ir.s.rs1, imm);
+            fprintf(out, "      uint8_t *p = translate(c->write_pages, a, %u);\n", 1 << ir.s.funct3);
+            fprintf(out, "      if (!p) EXIT(0x%08xu, %u, %u, %u);\n", pc, n, k, f);
+            fprintf(out, "      %sx[%u];\n", store[ir.s.funct3], ir.s.rs2);
+            fprintf(out, "      if ((a >> 2) == (c->tohost >> 2)) EXIT(0x%08xu, %u, %u, %u); }\n",
+                    next, n + cpi, k + 1, g);
+            break;
+        case OP_MISCMEM:
+            break; // FENCE and FENCE.I are no-ops
+        default:
+            assert(false); // rejected by aot_translatable()
+    }
+}
+
+// Emits the block starting at `leader`. Returns false if its first
+// instruction has to be interpreted.
+static bool aot_emit_block(FILE *out, const mem_t *mem, const memregion_t *region, memaddr_t leader,
+                           unsigned int *max_cycles, unsigned int *last_fetch) {
+    unsigned int cpi = yarvis_cycles_per_instruction;
+    unsigned int k = 0, f = 0, length;
+    memaddr_t pc = leader;
+    instruction_t ir;
+
+    for (; (k < AOT_MAX_BLOCK) && (pc - region->address < region->size); k++, pc += length, f += length / 2) {
+        length = aot_decode(mem, region, pc, &ir);
+        if (!length || !aot_translatable(ir)) {
+            break;
+        }
+        if (!k) {
+            fprintf(out, "static void b%08x(aot_context_t *c) {\n    uint32_t *x = c->regs;\n", leader);
+        }
+        aot_emit(out, ir, pc, length, k * cpi, k, f);
+        if (aot_is_transfer(ir)) {
+            *max_cycles = (k + 1) * cpi + ((ir.r.opcode == OP_BRANCH) ? yarvis_cycles_per_taken_branch : 0);
+            *last_fetch = k * cpi;
+            fprintf(out, "}\n\n");
+            return true;
+        }
+    }
+    if (!k) {
+        return false;
+    }
+    *max_cycles = k * cpi;
+    *last_fetch = (k - 1) * cpi;
+    fprintf(out, "    EXIT(0x%08xu, %u, %u, %u);\n}\n\n", pc, k * cpi, k, f);
+    return true;
+}
+
+static void aot_mark(uint8_t *leaders, memaddr_t base, memaddr_t num_slots, memaddr_t pc) {
+    memaddr_t slot = (pc - base) >> 1;
+    if (!(pc & 1) && (slot < num_slots)) {
+        leaders[slot] = 1;
+    }
+}
+
+static bool aot_generate(const mem_t *mem, memaddr_t base, memaddr_t num_slots, FILE *out) {
+    uint8_t *leaders = calloc(num_slots, 1);
+    unsigned int num_blocks = 0;
+    CHECK(leaders);
+
+    aot_mark(leaders, base, num_slots, mem->entry_point);
+    for (unsigned int i = 0; i < mem->num_regions; i++) {
+        const memregion_t *region = mem->regions + i;
+        if (!region->executable) {
+            continue;
+        }
+        aot_mark(leaders, base, num_slots, region->address);
+        // Data mixed into the text can put this sweep out of step with the
+        // instruction stream; a leader it misses only costs a longer block.
+        unsigned int length;
+        for (memaddr_t pc = region->address; pc < region->address + region->size; pc += length) {
+            instruction_t ir;
+            if (!(length = aot_decode(mem, region, pc, &ir))) {
+                break;
+            } else if (!aot_translatable(ir)) {
+                aot_mark(leaders, base, num_slots, pc + length);
+            } else if (aot_is_transfer(ir)) {
+                aot_mark(leaders, base, num_slots, pc + length);
+                if (ir.r.opcode != OP_JALR) {
+                    aot_mark(leaders, base, num_slots, pc + aot_imm(ir));
+                }
+            }
+        }
+    }
+
+    fprintf(out, "#define PAGE_SHIFT %d\n%s\n", PAGE_SHIFT, aot_preamble);
+    memaddr_t *pcs = malloc(num_slots * sizeof(memaddr_t));
+    unsigned int *cycles = malloc(2 * num_slots * sizeof(unsigned int));
+    CHECK(pcs && cycles);
+    for (unsigned int i = 0; i < mem->num_regions; i++) {
+        const memregion_t *region = mem->regions + i;
+        for (memaddr_t pc = region->address; region->executable && (pc < region->address + region->size); pc += 2) {
+            if (leaders[(pc - base) >> 1]
+                && aot_emit_block(out, mem, region, pc, cycles + 2 * num_blocks, cycles + 2 * num_blocks + 1)) {
+                pcs[num_blocks++] = pc;
+            }
+        }
+    }
+    fprintf(out, "const unsigned int aot_abi = %d;\n", AOT_ABI);
+    fprintf(out, "const unsigned int aot_num_blocks = %u;\n", num_blocks);
+    fprintf(out, "const aot_block_t aot_blocks[] = {\n");
+    for (unsigned int i = 0; i < num_blocks; i++) {
+        fprintf(out, "    { 0x%08xu, %u, %u, b%08x },\n", pcs[i], cycles[2 * i], cycles[2 * i + 1], pcs[i]);
+    }
+    fprintf(out, "    { 0, 0, 0, 0 },\n};\n");
+    free(cycles);
+    free(pcs);
+    free(leaders);
+    return num_blocks > 0;
+}
+
+// FNV-1a over the ELF image and everything else the generated code
+// depends on.
+static uint64_t aot_hash(FILE *elffile) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const unsigned int params[] = {
+        AOT_ABI, NUM_REGS, PAGE_SHIFT, yarvis_cycles_per_instruction, yarvis_cycles_per_taken_branch,
+    };
+    int ch;
+    for (size_t i = 0; i < sizeof(params); i++) {
+        hash = (hash ^ ((const uint8_t *)params)[i]) * 0x100000001b3ull;
+    }
+    CHECK(!fseek(elffile, 0, SEEK_SET));
+    while ((ch = getc(elffile)) != EOF) {
+        hash = (hash ^ (uint8_t)ch) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Compiles `source` to the shared object `object` with the host compiler
+// ($CC, or cc). The compiler is run directly rather than through a shell, so
+// the paths need no quoting.
+static bool aot_compile(const char *source, const char *object) {
+    const char *cc = getenv("CC");
+    char *argv[] = { (char *)(cc ? cc : "cc"), "-O2", "-shared", "-fPIC", "-o", (char *)object, (char *)source, NULL };
+    int status;
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+    return (waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+// Loads the translation of the ELF from the cache, compiling it with the
+// host compiler ($CC, or cc) first if necessary. Returns NULL if there is
+// nothing to translate or the translation is unusable; the interpreter
+// then runs everything.
+aot_t *aot_load(mem_t *mem, FILE *elffile, const char *cache_dir) {
+    char path[4000], source[4096], object[4096];
+    memaddr_t start = ~(memaddr_t)0, end = 0;
+    aot_t *aot;
+
+    CHECK(XLEN == 32);
+    for (unsigned int i = 0; i < mem->num_regions; i++) {
+        const memregion_t *region = mem->regions + i;
+        if (region->executable) {
+            start = (region->address < start) ? region->address : start;
+            end = (region->address + region->size > end) ? region->address + region->size : end;
+        }
+    }
+    if (start >= end) {
+        fprintf(stderr, "AOT: no executable segments, interpreting\n");
+        return NULL;
+    }
+
+    CHECK(snprintf(path, sizeof(path), "%s/yarvis-%016llx.so", cache_dir,
+                   (unsigned long long)aot_hash(elffile)) < (int)sizeof(path));
+    if (access(path, R_OK)) {
+        FILE *out;
+        snprintf(source, sizeof(source), "%s.%ld.c", path, (long)getpid());
+        snprintf(object, sizeof(object), "%s.%ld.tmp", path, (long)getpid());
+        if (!(out = fopen(source, "w"))) {
+            perror(source);
+            return NULL;
+        }
+        bool translated = aot_generate(mem, start, (end - start) >> 1, out);
+        fclose(out);
+        if (!translated || !aot_compile(source, object) || rename(object, path)) {
+            fprintf(stderr, "AOT: translation failed, interpreting\n");
+            unlink(source);
+            unlink(object);
+            return NULL;
+        }
+        unlink(source);
+    }
+
+    aot = calloc(1, sizeof(aot_t));
+    CHECK(aot);
+    aot->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    const unsigned int *abi = aot->handle ? dlsym(aot->handle, "aot_abi") : NULL;
+    const unsigned int *num_blocks = aot->handle ? dlsym(aot->handle, "aot_num_blocks") : NULL;
+    const aot_block_t *blocks = aot->handle ? dlsym(aot->handle, "aot_blocks") : NULL;
+    if (!abi || !num_blocks || !blocks || (*abi != AOT_ABI)) {
+        fprintf(stderr, "AOT: %s is unusable, interpreting\n", path);
+        aot_destroy(aot);
+        return NULL;
+    }
+    aot->base = start;
+    aot->num_slots = (end - start) >> 1;
+    aot->lookup = calloc(aot->num_slots, sizeof(*aot->lookup));
+    CHECK(aot->lookup);
+    for (unsigned int i = 0; i < *num_blocks; i++) {
+        CHECK(blocks[i].pc - start < end - start);
+        aot->lookup[(blocks[i].pc - start) >> 1] = blocks + i;
+    }
+    aot->context.tohost = mem->symbols[SYM_TOHOST];
+    return aot;
+}
+
+// Runs the translated block at *pc, if there is one and it can complete
+// within `budget` cycles without an interrupt being taken part-way
+// through. Returns false if the interpreter has to take the next step.
+bool aot_execute(aot_t *aot, mem_t *mem, regfile_t *regs, csrfile_t *csrs, memword_t *pc,
+                 unsigned long budget, unsigned long *cycles) {
+    memaddr_t slot = (*pc - aot->base) >> 1;
+    const aot_block_t *block;
+    aot_context_t *context = &aot->context;
+
+    if ((*pc & 1) || (slot >= aot->num_slots) || !(block = aot->lookup[slot]) || !yarvis_fetching()) {
+        return false;
+    }
+    if (block->max_cycles > budget) {
+        return false;
+    }
+    if ((csrs->mstatus & MSTATUS_MIE) && (csrs->mie & MIP_MTIP)
+        && (clint_load(&mem->clint.mtimecmp[csrs->mhartid]) <= clint_load(&mem->clint.mtime) + block->last_fetch)) {
+        return false;
+    }
+    context->regs = *regs;
+    context->pages = mem->pages;
+    context->write_pages = mem->write_pages;
+    context->cycles = 0;
+    context->instret = 0;
+    context->parcels = 0;
+    block->fn(context);
+    if (!context->cycles) {
+        return false; // the first instruction needs the interpreter
+    }
+    *pc = context->pc;
+    *cycles = context->cycles;
+    csrs->minstret += context->instret;
+    csrs->fetch_parcels += context->parcels;
+    return true;
+}
+
+void aot_destroy(aot_t *aot) {
+    assert(aot);
+    if (aot->handle) {
+        dlclose(aot->handle);
+    }
+    free(aot->lookup);
+    free(aot);
+}
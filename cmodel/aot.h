@@ -0,0 +1,41 @@
+#ifndef _aot_h_
+#define _aot_h_
+
+// Layout shared with the generated code in aot.c; bump AOT_ABI whenever
+// either of these structures or the translation scheme changes.
+#define AOT_ABI 2
+
+typedef struct {
+    memword_t *regs;
+    uint8_t *const *pages;
+    uint8_t *const *write_pages;
+    memaddr_t tohost;
+    memword_t pc;
+    unsigned long cycles;
+    uint64_t instret;
+    uint64_t parcels; // 16-bit instruction parcels fetched
+} aot_context_t;
+
+typedef void aot_block_fn_t(aot_context_t *context);
+
+typedef struct {
+    memaddr_t pc;
+    unsigned int max_cycles; // cycles taken if the whole block runs
+    unsigned int last_fetch; // cycle of the last instruction fetch
+    aot_block_fn_t *fn;
+} aot_block_t;
+
+typedef struct {
+    void *handle;
+    memaddr_t base;
+    memaddr_t num_slots;        // lookup covers base + 2 * [0, num_slots)
+    const aot_block_t **lookup; // block starting at each address, or NULL
+    aot_context_t context;
+} aot_t;
+
+aot_t *aot_load(mem_t *mem, FILE *elffile, const char *cache_dir);
+bool aot_execute(aot_t *aot, mem_t *mem, regfile_t *regs, csrfile_t *csrs, memword_t *pc,
+                 unsigned long budget, unsigned long *cycles);
+void aot_destroy(aot_t *aot);
+
+#endif // _aot_h_
@@ -0,0 +1,150 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "mem.h"
+#include "riscv.h"
+#include "rvc.h"
+#include "coverage.h"
+
+// Collection is enabled by pointing this at a map
+coverage_t *yarvis_coverage;
+
+static unsigned int coverage_class(instruction_t ir) {
+    unsigned int funct3 = ir.r.funct3, funct7 = 0;
+    switch (ir.r.opcode) {
+        case OP_LUI:
+        case OP_AUIPC:
+        case OP_JAL:
+            funct3 = 0; // immediate bits
+            break;
+        case OP_OP:
+            funct7 = ir.r.funct7;
+            break;
+        case OP_AMO:
+            funct7 = ir.r.funct7 & ~3; // funct5, without aq and rl
+            break;
+        case OP_OPIMM:
+            if ((funct3 == F3_SLL) || (funct3 == F3_SRL_SRA)) {
+                funct7 = ir.r.funct7;
+            }
+            break;
+        case OP_SYSTEM:
+            if (funct3 == F3_PRIV) {
+                // ECALL, EBREAK, MRET and WFI differ in funct7 | imm[0]
+                funct7 = ir.r.funct7 | (ir.i.imm11_0 & 1);
+            }
+            break;
+        default:
+            break;
+    }
+    return COVERAGE_CLASS(ir.r.opcode, funct3, funct7);
+}
+
+static uint8_t coverage_value(memword_t value, coverage_corner_t zero, coverage_corner_t negative) {
+    return !value ? (1 << zero) : (value >> (XLEN - 1)) ? (1 << negative) : 0;
+}
+
+// Whether the operation overflows for these operands, for the classes in
+// which that is a corner case of the datapath.
+static bool coverage_overflow(instruction_t ir, memword_t operand1, memword_t operand2) {
+    const memword_t sign = (memword_t)1 << (XLEN - 1);
+    bool add = (~(operand1 ^ operand2) & (operand1 ^ (operand1 + operand2))) & sign;
+    bool sub = ((operand1 ^ operand2) & (operand1 ^ (operand1 - operand2))) & sign;
+    smemword_t product;
+    memword_t result;
+    switch (ir.r.opcode) {
+        case OP_OP:
+            if (ir.r.funct7 == F7_MULDIV) {
+                switch (ir.r.funct3) {
+                    case F3_DIV:
+                    case F3_REM:
+                        return (operand1 == sign) && (operand2 == (memword_t)-1);
+                    case F3_DIVU:
+                    case F3_REMU:
+                        return false;
+                    case F3_MULHU:
+                        return __builtin_mul_overflow(operand1, operand2, &result);
+                    case F3_MULHSU: // rs1 signed, rs2 unsigned
+                        return __builtin_mul_overflow((smemword_t)operand1, operand2, &product);
+                    default:
+                        return __builtin_mul_overflow((smemword_t)operand1, (smemword_t)operand2, &product);
+                }
+            }
+            if ((ir.r.funct3 == F3_ADD_SUB) && (ir.r.funct7 & 0x20)) {
+                return sub;
+            }
+            // fallthrough
+        case OP_OPIMM:
+            switch (ir.r.funct3) {
+                case F3_ADD_SUB:
+                    return add;
+                case F3_SLT:
+                case F3_SLTU:
+                    return sub;
+                default:
+                    return false;
+            }
+        case OP_BRANCH:
+            return sub;
+        default:
+            return false;
+    }
+}
+
+// Samples the instruction at `pc` and the operands it reads, before the
+// model executes it.
+void coverage_fetch(coverage_t *coverage, const mem_t *mem, regfile_t *regs, memword_t pc) {
+    uint16_t parcel = mem_peek(mem, pc, 2);
+    instruction_t ir;
+    if (RVC_IS_COMPRESSED(parcel)) {
+        unsigned int bit = ((parcel & 3) << 3) | (parcel >> 13);
+        coverage->map.compressed[bit >> 3] |= 1 << (bit & 7);
+        ir.raw = rvc_expand(parcel);
+        coverage->length = 2;
+    } else {
+        ir.raw = parcel | (uint32_t)mem_peek(mem, pc + 2, 2) << 16;
+        coverage->length = 4;
+    }
+
+    bool uses_rs1 = (ir.r.opcode != OP_LUI) && (ir.r.opcode != OP_AUIPC) && (ir.r.opcode != OP_JAL)
+                    && !((ir.r.opcode == OP_SYSTEM) && ((ir.r.funct3 & 4) || (ir.r.funct3 == F3_PRIV)));
+    bool uses_rs2 = (ir.r.opcode == OP_OP) || (ir.r.opcode == OP_AMO) || (ir.r.opcode == OP_STORE)
+                    || (ir.r.opcode == OP_BRANCH);
+    coverage->ir = ir;
+    coverage->pc = pc;
+    coverage->operand1 = (uses_rs1 && (ir.r.rs1 < NUM_REGS)) ? (*regs)[ir.r.rs1] : 0;
+    coverage->operand2 = (uses_rs2 && (ir.r.rs2 < NUM_REGS)) ? (*regs)[ir.r.rs2]
+                         : (memword_t)((smemword_t)(int32_t)ir.raw >> 20); // I-type immediate
+    coverage->corners = 1 << CORNER_EXECUTED;
+    if (uses_rs1) {
+        coverage->corners |= coverage_value(coverage->operand1, CORNER_OPERAND1_ZERO, CORNER_OPERAND1_NEGATIVE);
+    }
+    if (uses_rs2 || (ir.r.opcode == OP_OPIMM)) {
+        coverage->corners |= coverage_value(coverage->operand2, CORNER_OPERAND2_ZERO, CORNER_OPERAND2_NEGATIVE);
+    }
+    if (coverage_overflow(ir, coverage->operand1, coverage->operand2)) {
+        coverage->corners |= 1 << CORNER_OVERFLOW;
+    }
+}
+
+// Records the instruction sampled by coverage_fetch() once it has retired
+// and the model has moved on to `next_pc`.
+void coverage_retire(coverage_t *coverage, regfile_t *regs, memword_t next_pc) {
+    instruction_t ir = coverage->ir;
+    uint8_t corners = coverage->corners;
+    if (ir.r.opcode == OP_BRANCH) {
+        bool taken = (next_pc != coverage->pc + coverage->length);
+        corners |= 1 << (taken ? CORNER_RESULT_NEGATIVE : CORNER_RESULT_ZERO);
+    } else if ((ir.r.opcode != OP_STORE) && ir.r.rd && (ir.r.rd < NUM_REGS)) {
+        corners |= coverage_value((*regs)[ir.r.rd], CORNER_RESULT_ZERO, CORNER_RESULT_NEGATIVE);
+    }
+    coverage->map.classes[coverage_class(ir)] |= corners;
+}
+
+void coverage_write(const coverage_t *coverage, FILE *fh) {
+    const uint32_t header[] = { COVERAGE_VERSION, sizeof(coverage_map_t) };
+    CHECK((fwrite(COVERAGE_MAGIC, 4, 1, fh) == 1)
+          && (fwrite(header, sizeof(header), 1, fh) == 1)
+          && (fwrite(&coverage->map, sizeof(coverage_map_t), 1, fh) == 1));
+}
@@ -0,0 +1,57 @@
+#ifndef _coverage_h_
+#define _coverage_h_
+
+// Functional coverage: a bitmap of the instruction classes executed, the
+// operand corner cases each class has seen and the FSM state transitions
+// taken. Collected only while yarvis_coverage points at a map. Maps from
+// several runs are merged and minimized by coverage.py.
+
+#define COVERAGE_MAGIC "YCOV"
+#define COVERAGE_VERSION 1
+
+// Bits of the byte kept for each instruction class
+typedef enum {
+    CORNER_EXECUTED,
+    CORNER_OPERAND1_ZERO,
+    CORNER_OPERAND1_NEGATIVE,
+    CORNER_OPERAND2_ZERO,
+    CORNER_OPERAND2_NEGATIVE,
+    CORNER_RESULT_ZERO,     // or branch not taken
+    CORNER_RESULT_NEGATIVE, // or branch taken
+    CORNER_OVERFLOW,        // signed overflow, or division overflow
+} coverage_corner_t;
+
+#define COVERAGE_CLASS(opcode, funct3, funct7) (((opcode) << 10) | ((funct3) << 7) | (funct7))
+#define COVERAGE_NUM_CLASSES COVERAGE_CLASS(32, 0, 0)
+#define COVERAGE_MAX_STATES 8
+
+// Layout of the file after its header, shared with coverage.py
+typedef struct {
+    uint8_t classes[COVERAGE_NUM_CLASSES]; // corner bits by COVERAGE_CLASS()
+    uint8_t compressed[4];                 // bit quadrant << 3 | funct3
+    uint8_t transitions[COVERAGE_MAX_STATES * COVERAGE_MAX_STATES / 8]; // bit from << 3 | to
+} coverage_map_t;
+
+typedef struct {
+    coverage_map_t map;
+    // The instruction in flight, sampled when it was fetched
+    instruction_t ir;
+    memword_t pc;
+    unsigned int length;
+    memword_t operand1, operand2;
+    uint8_t corners; // known at fetch
+    uint64_t retired;
+} coverage_t;
+
+extern coverage_t *yarvis_coverage;
+
+void coverage_fetch(coverage_t *coverage, const mem_t *mem, regfile_t *regs, memword_t pc);
+void coverage_retire(coverage_t *coverage, regfile_t *regs, memword_t next_pc);
+void coverage_write(const coverage_t *coverage, FILE *fh);
+
+static inline void coverage_transition(coverage_t *coverage, unsigned int from, unsigned int to) {
+    unsigned int bit = (from << 3) | to;
+    coverage->map.transitions[bit >> 3] |= 1 << (bit & 7);
+}
+
+#endif // _coverage_h_
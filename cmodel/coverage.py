@@ -0,0 +1,104 @@
+"""Merges and minimizes the coverage maps written by yarvis_cmodel -C.
+
+    python3 coverage.py report run.cov...
+    python3 coverage.py merge merged.cov run.cov...
+    python3 coverage.py minimize run.cov...
+
+`minimize` prints a subset of the runs that together cover every point the
+whole set covers, so the tests they came from can stand in for the full
+suite. The subset is chosen greedily, then pruned of runs that turned out
+to be redundant; finding the smallest one exactly is NP-hard.
+"""
+
+import struct
+import sys
+
+MAGIC = b"YCOV"
+VERSION = 1
+HEADER = struct.Struct("<4sII")
+
+# Layout of coverage_map_t in coverage.h
+NUM_CLASSES = 32 << 10
+NUM_COMPRESSED = 4
+NUM_TRANSITIONS = 8
+
+# Table 74 "RISC-V base opcode map, inst[1:0] = 11"
+OPCODES = {0: "LOAD", 3: "MISC-MEM", 4: "OP-IMM", 5: "AUIPC", 8: "STORE", 11: "AMO", 12: "OP", 13: "LUI",
+           24: "BRANCH", 25: "JALR", 27: "JAL", 28: "SYSTEM"}
+CORNERS = ["executed", "rs1=0", "rs1<0", "op2=0", "op2<0", "result=0", "result<0", "overflow"]
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    magic, version, size = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION or len(data) != HEADER.size + size:
+        raise SystemExit(f"{path}: not a version {VERSION} coverage map")
+    return data[HEADER.size:]
+
+
+def points(bitmap):
+    """Set of the indices of the bits that are set."""
+    return {8 * i + bit for i, byte in enumerate(bitmap) if byte for bit in range(8) if byte >> bit & 1}
+
+
+def merge(bitmaps):
+    """Bitwise OR of equally sized bitmaps."""
+    merged = bytearray(bitmaps[0])
+    for bitmap in bitmaps[1:]:
+        if len(bitmap) != len(merged):
+            raise SystemExit("coverage maps of different sizes")
+        for i, byte in enumerate(bitmap):
+            merged[i] |= byte
+    return bytes(merged)
+
+
+def minimize(covered):
+    """Greedy set cover of the union of `covered`, a dict of name to points."""
+    remaining = set().union(*covered.values())
+    chosen = []
+    while remaining:
+        best = max(covered, key=lambda name: len(covered[name] & remaining))
+        chosen.append(best)
+        remaining -= covered[best]
+    for name in list(reversed(chosen)):
+        others = set().union(*(covered[other] for other in chosen if other != name))
+        if covered[name] <= others:
+            chosen.remove(name)
+    return chosen
+
+
+def report(bitmap):
+    classes = bitmap[:NUM_CLASSES]
+    compressed = bitmap[NUM_CLASSES:NUM_CLASSES + NUM_COMPRESSED]
+    transitions = bitmap[NUM_CLASSES + NUM_COMPRESSED:NUM_CLASSES + NUM_COMPRESSED + NUM_TRANSITIONS]
+    executed = [i for i, byte in enumerate(classes) if byte & 1]
+    print(f"{len(points(bitmap))} points: {len(executed)} instruction classes, "
+          f"{len(points(compressed))} compressed classes, {len(points(transitions))} FSM transitions")
+    for i in executed:
+        opcode, funct3, funct7 = i >> 10, i >> 7 & 7, i & 0x7f
+        name = OPCODES.get(opcode, f"opcode {opcode:#x}")
+        corners = " ".join(CORNERS[bit] for bit in range(1, 8) if classes[i] >> bit & 1)
+        print(f"    {name:<8} funct3={funct3} funct7={funct7:#04x}  {corners}")
+
+
+def main(argv):
+    if len(argv) >= 3 and argv[1] == "report":
+        report(merge([load(path) for path in argv[2:]]))
+    elif len(argv) >= 4 and argv[1] == "merge":
+        bitmap = merge([load(path) for path in argv[3:]])
+        with open(argv[2], "wb") as f:
+            f.write(HEADER.pack(MAGIC, VERSION, len(bitmap)) + bitmap)
+    elif len(argv) >= 3 and argv[1] == "minimize":
+        covered = {path: points(load(path)) for path in argv[2:]}
+        chosen = minimize(covered)
+        for path in chosen:
+            print(path)
+        print(f"{len(chosen)} of {len(covered)} runs cover all "
+              f"{len(set().union(*covered.values()))} points", file=sys.stderr)
+    else:
+        raise SystemExit(__doc__)
+
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -0,0 +1,92 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "mem.h"
+#include "dev.h"
+
+static memword_t console_read(void *context, memaddr_t offset, memaddr_t size) {
+    (void)context;
+    (void)size;
+    // The transmitter is always ready: characters are buffered on the host.
+    return (offset == UART_LSR) ? (UART_LSR_THRE | UART_LSR_TEMT) : 0;
+}
+
+static void console_write(void *context, memaddr_t offset, memaddr_t size, memword_t data) {
+    console_t *console = context;
+    (void)size;
+    if (offset != UART_THR) {
+        return; // configuration registers are ignored
+    }
+    console->buffer[console->length++] = data;
+    if ((console->length == CONSOLE_BUFSIZE) || (console->line_buffered && (data == '\n'))) {
+        console_flush(console);
+    }
+}
+
+void console_map(mem_t *mem, console_t *console, int fd) {
+    console->fd = fd;
+    console->line_buffered = isatty(fd);
+    console->length = 0;
+    mem_map_device(mem, &(memdevice_t){
+        .name = "uart",
+        .address = UART_BASE,
+        .size = UART_SIZE,
+        .read = console_read,
+        .write = console_write,
+        .context = console,
+    });
+}
+
+void console_flush(console_t *console) {
+    size_t written = 0;
+    while (written < console->length) {
+        ssize_t n = write(console->fd, console->buffer + written, console->length - written);
+        if (n < 0) {
+            perror("console");
+            break;
+        }
+        written += n;
+    }
+    console->length = 0;
+}
+
+static memword_t sysctl_read(void *context, memaddr_t offset, memaddr_t size) {
+    sysctl_t *sysctl = context;
+    CHECK(size == 4);
+    switch (offset) {
+        // Harts other than 0 read its time from their own threads
+        case SYSCTL_CYCLE:
+            return __atomic_load_n(sysctl->cycles, __ATOMIC_RELAXED);
+        case SYSCTL_CYCLEH:
+            return (uint64_t)__atomic_load_n(sysctl->cycles, __ATOMIC_RELAXED) >> 32;
+        default:
+            return 0;
+    }
+}
+
+static void sysctl_write(void *context, memaddr_t offset, memaddr_t size, memword_t data) {
+    sysctl_t *sysctl = context;
+    CHECK(size == 4);
+    if (offset == SYSCTL_EXIT) {
+        // Harts on other threads poll exited, then read status
+        sysctl->status = data;
+        __atomic_store_n(&sysctl->exited, true, __ATOMIC_RELEASE);
+    }
+}
+
+void sysctl_map(mem_t *mem, sysctl_t *sysctl, const unsigned long *cycles) {
+    sysctl->exited = false;
+    sysctl->status = 0;
+    sysctl->cycles = cycles;
+    mem_map_device(mem, &(memdevice_t){
+        .name = "sysctl",
+        .address = SYSCTL_BASE,
+        .size = SYSCTL_SIZE,
+        .read = sysctl_read,
+        .write = sysctl_write,
+        .context = sysctl,
+    });
+}
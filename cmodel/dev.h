@@ -0,0 +1,40 @@
+#ifndef _dev_h_
+#define _dev_h_
+
+// 16550-compatible transmitter; only THR and LSR are implemented.
+#define UART_BASE       0x10000000
+#define UART_SIZE       0x00000100
+#define UART_THR        0x0
+#define UART_LSR        0x5
+#define UART_LSR_THRE   (1 << 5)
+#define UART_LSR_TEMT   (1 << 6)
+
+#define CONSOLE_BUFSIZE 65536
+
+typedef struct {
+    int fd;
+    bool line_buffered;
+    size_t length;
+    char buffer[CONSOLE_BUFSIZE];
+} console_t;
+
+void console_map(mem_t *mem, console_t *console, int fd);
+void console_flush(console_t *console);
+
+// Simulation control: writing EXIT ends the run with the written status,
+// and CYCLE/CYCLEH read the number of elapsed simulated cycles.
+#define SYSCTL_BASE     0x00100000
+#define SYSCTL_SIZE     0x00001000
+#define SYSCTL_EXIT     0x0
+#define SYSCTL_CYCLE    0x8
+#define SYSCTL_CYCLEH   0xc
+
+typedef struct {
+    bool exited;
+    memword_t status;
+    const unsigned long *cycles;
+} sysctl_t;
+
+void sysctl_map(mem_t *mem, sysctl_t *sysctl, const unsigned long *cycles);
+
+#endif // _dev_h_
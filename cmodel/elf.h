@@ -18,10 +18,16 @@ typedef uint32_t Elf32_Word;
 #define ELFCLASS32 1
 #define ELFDATA2LSB 1
 #define PT_LOAD 1
+#define PF_X 1
 #define SHT_SYMTAB 2
 #define SHT_STRTAB 3
 #define STB_GLOBAL 1
+#define STT_NOTYPE 0
+#define STT_OBJECT 1
+#define STT_FUNC 2
+#define SHN_UNDEF 0
 #define ELF32_ST_BIND(i) ((i)>>4)
+#define ELF32_ST_TYPE(i) ((i)&0xf)
 
 typedef struct {
     unsigned char   e_ident[EI_NIDENT];
@@ -0,0 +1,419 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "mem.h"
+#include "dev.h"
+#include "riscv.h"
+#include "rvc.h"
+#include "lanes.h"
+
+extern memword_t yarvis_step(mem_t *mem, regfile_t *regs, csrfile_t *csrs, memword_t pc);
+extern bool yarvis_fetching(void);
+
+// Vectors are passed by pointer or through macros: passing them by value
+// would depend on the vector extensions the build targets.
+#define LANES_SELECT(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+// Bit i is set for each lane i that `mask` selects
+static inline unsigned int lanes_bits(const lanes_word_t *mask) {
+    unsigned int bits = 0;
+    for (unsigned int i = 0; i < LANES; i++) {
+        bits |= (unsigned int)((*mask)[i] & 1) << i;
+    }
+    return bits;
+}
+
+// The text is tracked in 64-byte lines, one 64-bit word per page
+#define LINE_SHIFT 6
+
+static inline void lanes_mark(lanes_t *lanes, memaddr_t address) {
+    memaddr_t offset = address - lanes->text_start;
+    if (offset < lanes->text_size) {
+        lanes->text_written[offset >> PAGE_SHIFT] |= (uint64_t)1 << ((offset >> LINE_SHIFT) & 63);
+    }
+}
+
+// Notes a poke or a store to [address, address + size) in any lane, so that
+// lanes_issue() knows where in the text the lanes may differ.
+void lanes_written(lanes_t *lanes, memaddr_t address, memaddr_t size) {
+    for (memaddr_t offset = 0; offset < size; offset += (memaddr_t)1 << LINE_SHIFT) {
+        lanes_mark(lanes, address + offset);
+    }
+    if (size) {
+        lanes_mark(lanes, address + size - 1);
+    }
+}
+
+// True if the lanes may hold different instructions at `address`: some lane
+// wrote to its line, or it is outside the text, where writes are not tracked
+static inline bool lanes_text_written(const lanes_t *lanes, memaddr_t address) {
+    memaddr_t offset = address - lanes->text_start;
+    return (offset >= lanes->text_size)
+           || ((lanes->text_written[offset >> PAGE_SHIFT] >> ((offset >> LINE_SHIFT) & 63)) & 1);
+}
+
+// Loads another instance of the program into the next free lane and
+// returns its index.
+unsigned int lanes_add(lanes_t *lanes, FILE *elffile, int console_fd) {
+    unsigned int i = lanes->count++;
+    CHECK(i < LANES);
+    mem_t *mem = lanes->mem[i] = mem_loadelf(elffile);
+    if (!i) {
+        memaddr_t end = 0;
+        lanes->text_start = ~(memaddr_t)0;
+        for (unsigned int r = 0; r < mem->num_regions; r++) {
+            const memregion_t *region = mem->regions + r;
+            if (region->executable) {
+                lanes->text_start = (region->address < lanes->text_start) ? region->address : lanes->text_start;
+                end = (region->address + region->size > end) ? region->address + region->size : end;
+            }
+        }
+        lanes->text_size = (end > lanes->text_start) ? end - lanes->text_start : 0;
+        lanes->text_written = calloc((lanes->text_size >> PAGE_SHIFT) + 1, sizeof(uint64_t));
+        CHECK(lanes->text_written);
+    }
+    for (unsigned int r = 0; r < NUM_REGS; r++) {
+        lanes->regs[r][i] = 0;
+    }
+    lanes->pc[i] = mem->entry_point;
+    lanes->active[i] = ~(memword_t)0;
+    lanes->retired[i] = 0;
+    lanes->limit[i] = 0;
+    lanes->csrs[i] = (csrfile_t){ 0 };
+    lanes->tohost[i] = 0;
+    lanes->time[i] = 0;
+    console_map(mem, &lanes->console[i], console_fd);
+    sysctl_map(mem, &lanes->sysctl[i], &lanes->time[i]);
+    return i;
+}
+
+void lanes_clear(lanes_t *lanes) {
+    for (unsigned int i = 0; i < lanes->count; i++) {
+        mem_destroy(lanes->mem[i]);
+        lanes->mem[i] = NULL;
+    }
+    lanes->count = 0;
+    lanes->active = (lanes_word_t){ 0 };
+    free(lanes->text_written);
+    lanes->text_written = NULL;
+}
+
+// Stops the lanes in `bits` that have signalled completion, as sim_run()
+// does after every cycle; only stores and single-stepped instructions can.
+static void lanes_check_done(lanes_t *lanes, unsigned int bits) {
+    for (; bits; bits &= bits - 1) {
+        unsigned int i = __builtin_ctz(bits);
+        const mem_t *mem = lanes->mem[i];
+        if ((lanes->tohost[i] = mem_peek(mem, mem->symbols[SYM_TOHOST], 4)) || lanes->sysctl[i].exited) {
+            lanes->active[i] = 0;
+        }
+    }
+}
+
+// Single-steps the instruction at the pc of lane `i` through the model,
+// for the instructions without a vector implementation.
+static void lanes_fallback(lanes_t *lanes, unsigned int i) {
+    regfile_t regs;
+    csrfile_t *csrs = &lanes->csrs[i];
+    memword_t pc = lanes->pc[i];
+    instruction_t ir = { .raw = mem_peek(lanes->mem[i], pc, 2) };
+
+    for (unsigned int r = 0; r < NUM_REGS; r++) {
+        regs[r] = lanes->regs[r][i];
+    }
+    if (RVC_IS_COMPRESSED(ir.raw)) {
+        ir.raw = rvc_expand(ir.raw);
+    } else {
+        ir.raw |= (uint32_t)mem_peek(lanes->mem[i], pc + 2, 2) << 16;
+    }
+    if ((ir.i.opcode == OP_SYSTEM) && (ir.i.funct3 == F3_PRIV) && (ir.i.imm11_0 == F12_WFI)
+        && !csr_pending(csrs, lanes->mem[i])) {
+        // The model would stall in WFI for good; stop the lane at it, as
+        // lanes_issue() does
+        lanes->active[i] = 0;
+        return;
+    }
+    if (((ir.r.opcode == OP_STORE) || (ir.r.opcode == OP_AMO)) && (ir.r.rs1 < NUM_REGS)) {
+        memword_t imm_s = ((memword_t)((int32_t)ir.raw >> 25) << 5) | ir.s.imm4_0;
+        lanes_written(lanes, regs[ir.r.rs1] + ((ir.r.opcode == OP_STORE) ? imm_s : 0), sizeof(memword_t));
+    }
+    csrs->minstret = lanes->time[i] = lanes->retired[i];
+    do {
+        pc = yarvis_step(lanes->mem[i], &regs, csrs, pc);
+    } while (!yarvis_fetching());
+    for (unsigned int r = 0; r < NUM_REGS; r++) {
+        lanes->regs[r][i] = regs[r];
+    }
+    lanes->pc[i] = pc;
+    lanes->retired[i] = csrs->minstret;
+}
+
+// Executes the instruction at `pc` in all the running lanes at that pc. It
+// is fetched from the memory of lane `first`, one of them. Where a poke or a
+// store may have changed the text of some lanes, the others check that they
+// hold the same instruction, and are stepped on their own if not.
+static void lanes_issue(lanes_t *lanes, memword_t pc, unsigned int first) {
+    lanes_word_t mask = lanes->active & (lanes_word_t)(lanes->pc == pc);
+    const mem_t *leader = lanes->mem[first];
+    instruction_t ir = { .raw = mem_peek(leader, pc, 2) };
+    memword_t length = RVC_IS_COMPRESSED(ir.raw) ? 2 : 4;
+    unsigned int check = 0;
+    if (length == 4) {
+        ir.raw |= (uint32_t)mem_peek(leader, pc + 2, 2) << 16;
+    }
+    if (lanes_text_written(lanes, pc) || lanes_text_written(lanes, pc + length - 1)) {
+        check = lanes_bits(&mask) & ~(1u << first);
+    }
+    for (unsigned int lanebits = check; lanebits; lanebits &= lanebits - 1) {
+        unsigned int i = __builtin_ctz(lanebits);
+        if ((mem_peek(lanes->mem[i], pc, 2) != (ir.raw & 0xffff))
+            || ((length == 4) && (mem_peek(lanes->mem[i], pc + 2, 2) != (ir.raw >> 16)))) {
+            mask[i] = 0;
+            lanes_fallback(lanes, i);
+            lanes_check_done(lanes, 1u << i);
+        }
+    }
+    if (length == 2) {
+        ir.raw = rvc_expand(ir.raw);
+    }
+
+    // Section 2.3 "Immediate Encoding Variants"
+    memword_t sign = (ir.raw & (1u << 31)) ? ~(memword_t)0 : 0;
+    memword_t imm_i = (sign << 12) | ir.i.imm11_0;
+    memword_t imm_s = (sign << 12) | (ir.s.imm11_5 << 5) | ir.s.imm4_0;
+    memword_t imm_b = (sign << 12) | (ir.b.imm11 << 11) | (ir.b.imm10_5 << 5) | (ir.b.imm4_1 << 1);
+    memword_t imm_u = (sign << 31) | (ir.raw & 0xfffff000);
+    memword_t imm_j = (sign << 20) | (ir.j.imm19_12 << 12) | (ir.j.imm11 << 11) | (ir.j.imm10_1 << 1);
+
+    lanes_word_t *regs = lanes->regs;
+    lanes_word_t next = lanes->pc + length;
+    lanes_word_t operand1 = regs[ir.r.rs1 % NUM_REGS], operand2, result = { 0 }, data = { 0 };
+    lanes_sword_t taken = { 0 };
+    bool writes_rd = true, arith;
+    unsigned int bits, shift, size = 1 << (ir.i.funct3 & 3);
+
+#if RV32E
+    // Chapter 4 "RV32E Base Integer Instruction Set": reserved registers are
+    // left for the model to diagnose
+    if ((ir.r.rd >= NUM_REGS) || (ir.r.rs1 >= NUM_REGS) || (ir.r.rs2 >= NUM_REGS)) {
+        goto fallback;
+    }
+#endif
+    if (!ir.raw) {
+        goto fallback; // illegal compressed instruction
+    }
+    switch (ir.r.opcode) {
+        case OP_OP: // Section 2.4.2 "Integer Register-Register Operations"
+            operand2 = regs[ir.r.rs2 % NUM_REGS];
+            if ((ir.r.funct7 == F7_MULDIV) && (ir.r.funct3 == F3_MUL)) {
+                result = operand1 * operand2;
+                break;
+            }
+            if ((ir.r.funct7 & ~0x20)
+                || ((ir.r.funct7 & 0x20) && (ir.r.funct3 != F3_ADD_SUB) && (ir.r.funct3 != F3_SRL_SRA))) {
+                goto fallback;
+            }
+            arith = ir.r.funct7 & 0x20;
+            goto alu;
+        case OP_OPIMM: // Section 2.4.1 "Integer Register-Immediate Instructions"
+            operand2 = (lanes_word_t){ 0 } + imm_i;
+            if (((ir.r.funct3 == F3_SLL) || (ir.r.funct3 == F3_SRL_SRA))
+                && (ir.i.imm11_0 & ~(XLEN - 1) & ~((ir.r.funct3 == F3_SLL) ? 0 : 0x400))) {
+                goto fallback;
+            }
+            arith = (ir.r.funct3 == F3_SRL_SRA) && (ir.i.imm11_0 & 0x400);
+        alu:
+            switch (ir.r.funct3) {
+                case F3_ADD_SUB:
+                    result = arith ? operand1 - operand2 : operand1 + operand2;
+                    break;
+                case F3_SLL:
+                    result = operand1 << (operand2 & (XLEN - 1));
+                    break;
+                case F3_SLT:
+                    result = (lanes_word_t)((lanes_sword_t)operand1 < (lanes_sword_t)operand2) & 1;
+                    break;
+                case F3_SLTU:
+                    result = (lanes_word_t)(operand1 < operand2) & 1;
+                    break;
+                case F3_XOR:
+                    result = operand1 ^ operand2;
+                    break;
+                case F3_SRL_SRA:
+                    result = arith ? (lanes_word_t)((lanes_sword_t)operand1 >> (operand2 & (XLEN - 1)))
+                                   : operand1 >> (operand2 & (XLEN - 1));
+                    break;
+                case F3_OR:
+                    result = operand1 | operand2;
+                    break;
+                default: // F3_AND
+                    result = operand1 & operand2;
+                    break;
+            }
+            break;
+        case OP_LUI:
+            result = (lanes_word_t){ 0 } + imm_u;
+            break;
+        case OP_AUIPC:
+            result = lanes->pc + imm_u;
+            break;
+        // Section 2.5.1 "Unconditional Jumps"
+        case OP_JAL:
+            result = next;
+            next = (lanes_word_t){ 0 } + (pc + imm_j);
+            break;
+        case OP_JALR:
+            if (ir.i.funct3 != F3_JALR) {
+                goto fallback;
+            }
+            result = next;
+            next = (operand1 + imm_i) & ~(memword_t)1;
+            break;
+        // Section 2.5.2 "Conditional Branches"
+        case OP_BRANCH:
+            operand2 = regs[ir.b.rs2 % NUM_REGS];
+            switch (ir.b.funct3) {
+                case F3_BEQ:
+                    taken = operand1 == operand2;
+                    break;
+                case F3_BNE:
+                    taken = operand1 != operand2;
+                    break;
+                case F3_BLT:
+                    taken = (lanes_sword_t)operand1 < (lanes_sword_t)operand2;
+                    break;
+                case F3_BGE:
+                    taken = (lanes_sword_t)operand1 >= (lanes_sword_t)operand2;
+                    break;
+                case F3_BLTU:
+                    taken = operand1 < operand2;
+                    break;
+                case F3_BGEU:
+                    taken = operand1 >= operand2;
+                    break;
+                default:
+                    goto fallback;
+            }
+            next = LANES_SELECT((lanes_word_t)taken, (lanes_word_t){ 0 } + (pc + imm_b), next);
+            writes_rd = false;
+            break;
+        // Section 2.6 "Load and Store Instructions": each lane accesses its
+        // own memory
+        case OP_LOAD:
+            if ((size > 4) || ((ir.i.funct3 & 4) && (size == 4))) {
+                goto fallback;
+            }
+            operand1 += imm_i;
+            bits = lanes_bits(&mask);
+            for (unsigned int lanebits = bits; lanebits; lanebits &= lanebits - 1) {
+                unsigned int i = __builtin_ctz(lanebits);
+                lanes->time[i] = lanes->retired[i];
+                data[i] = mem_read(lanes->mem[i], operand1[i], size);
+            }
+            shift = XLEN - 8 * size;
+            result = (ir.i.funct3 & 4) ? data : (lanes_word_t)((lanes_sword_t)(data << shift) >> shift);
+            break;
+        case OP_STORE:
+            if ((ir.s.funct3 & 4) || (size > 4)) {
+                goto fallback;
+            }
+            operand1 += imm_s;
+            operand2 = regs[ir.s.rs2 % NUM_REGS];
+            bits = lanes_bits(&mask);
+            for (unsigned int lanebits = bits; lanebits; lanebits &= lanebits - 1) {
+                unsigned int i = __builtin_ctz(lanebits);
+                lanes_mark(lanes, operand1[i]); // aligned, so within one line
+                mem_write(lanes->mem[i], operand1[i], size, operand2[i]);
+            }
+            lanes_check_done(lanes, bits);
+            writes_rd = false;
+            break;
+        // Section 2.7 "Memory Ordering Instructions": the lanes share no
+        // memory, so fences have nothing to order
+        case OP_MISCMEM:
+            if ((ir.i.funct3 != F3_FENCE) && (ir.i.funct3 != F3_FENCEI)) {
+                goto fallback;
+            }
+            writes_rd = false;
+            break;
+        // Section 3.3.3 "Wait for Interrupt": mtime never advances, so a
+        // lane waiting for the timer would wait forever. It stops at the WFI,
+        // which does not retire.
+        case OP_SYSTEM:
+            if ((ir.i.funct3 != F3_PRIV) || (ir.i.imm11_0 != F12_WFI)) {
+                goto fallback;
+            }
+            bits = lanes_bits(&mask);
+            for (unsigned int lanebits = bits; lanebits; lanebits &= lanebits - 1) {
+                unsigned int i = __builtin_ctz(lanebits);
+                if (!csr_pending(&lanes->csrs[i], lanes->mem[i])) {
+                    lanes->active[i] = 0;
+                    mask[i] = 0;
+                }
+            }
+            writes_rd = false;
+            break;
+        default:
+            goto fallback;
+    }
+
+    if (writes_rd && ir.r.rd) {
+        regs[ir.r.rd] = LANES_SELECT(mask, result, regs[ir.r.rd]);
+    }
+    lanes->pc = LANES_SELECT(mask, next, lanes->pc);
+    lanes->retired -= (lanes_count_t)__builtin_convertvector((lanes_sword_t)mask, lanes_scount_t);
+    return;
+
+fallback:
+    bits = lanes_bits(&mask);
+    for (unsigned int lanebits = bits; lanebits; lanebits &= lanebits - 1) {
+        lanes_fallback(lanes, __builtin_ctz(lanebits));
+    }
+    lanes_check_done(lanes, bits);
+}
+
+// Stops the lanes that have reached their limit, and returns the number of
+// issued groups at which the next one can reach its own.
+static uint64_t lanes_limit(lanes_t *lanes) {
+    uint64_t next = UINT64_MAX;
+    for (unsigned int i = 0; i < lanes->count; i++) {
+        if (!lanes->active[i] || !lanes->limit[i]) {
+            continue;
+        }
+        if (lanes->retired[i] >= lanes->limit[i]) {
+            lanes->active[i] = 0;
+        } else if (lanes->issued + (lanes->limit[i] - lanes->retired[i]) < next) {
+            next = lanes->issued + (lanes->limit[i] - lanes->retired[i]);
+        }
+    }
+    return next;
+}
+
+// Runs every lane until it signals completion or reaches its limit. Each
+// step issues the instruction at the lowest pc of any running lane, to all
+// the lanes at that pc: lanes that took the other side of a branch wait
+// until the ones behind them catch up, which is where if/else arms and
+// loops over different trip counts reconverge.
+void lanes_run(lanes_t *lanes) {
+    uint64_t check = lanes_limit(lanes);
+    for (;;) {
+        // Instructions are at least halfword aligned, so no pc is all ones
+        lanes_word_t pcs = LANES_SELECT(lanes->active, lanes->pc, ~(lanes_word_t){ 0 });
+        memword_t pc = pcs[0];
+        unsigned int first = 0;
+        for (unsigned int i = 1; i < LANES; i++) {
+            if (pcs[i] < pc) {
+                pc = pcs[i];
+                first = i;
+            }
+        }
+        if (pc == ~(memword_t)0) {
+            break;
+        }
+        lanes_issue(lanes, pc, first);
+        if (++lanes->issued >= check) {
+            check = lanes_limit(lanes);
+        }
+    }
+}
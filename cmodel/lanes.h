@@ -0,0 +1,54 @@
+#ifndef _lanes_h_
+#define _lanes_h_
+
+// Lane-parallel interpretation of independent instances of one program,
+// for sweeps over many inputs. Each lane has its own memory, devices and
+// CSRs; the register files are kept as a structure of arrays so that the
+// lanes at the same pc execute it together with vector ALU operations.
+// Lanes whose pcs diverge are masked off, and regroup when their pcs meet
+// again. Loads and stores go to each lane's memory in turn, and anything
+// but the base integer ALU, branch, jump and memory instructions is
+// single-stepped through yarvis_step() one lane at a time. Instructions are
+// fetched from one of the lanes at the pc; pokes and stores into the text
+// are tracked by 64-byte line (lanes_written()), and on those lines each
+// lane that holds another instruction is single-stepped instead.
+//
+// Time is counted in instructions: mtime does not advance, so timer
+// interrupts never fire, and a lane that waits for one stops.
+//
+// The vector types use the GCC vector extensions, which compile to AVX2 or
+// AVX-512 when the build targets them (make MARCH=native) and to narrower
+// vectors or scalar code otherwise.
+
+#define LANES 16
+
+typedef memword_t lanes_word_t __attribute__((vector_size(LANES * sizeof(memword_t))));
+typedef smemword_t lanes_sword_t __attribute__((vector_size(LANES * sizeof(memword_t))));
+typedef uint64_t lanes_count_t __attribute__((vector_size(LANES * sizeof(uint64_t))));
+typedef int64_t lanes_scount_t __attribute__((vector_size(LANES * sizeof(uint64_t))));
+
+typedef struct {
+    unsigned int count;           // instances loaded, at most LANES
+    lanes_word_t regs[NUM_REGS];  // regs[r][lane]
+    lanes_word_t pc;
+    lanes_word_t active;          // all ones in the lanes still running
+    lanes_count_t retired;        // instructions retired by each lane
+    uint64_t limit[LANES];        // on retired instructions, 0 for none
+    uint64_t issued;              // groups of lanes issued, for statistics
+    mem_t *mem[LANES];
+    csrfile_t csrs[LANES];
+    memword_t tohost[LANES];
+    unsigned long time[LANES];    // read through sysctl, in instructions
+    sysctl_t sysctl[LANES];
+    console_t console[LANES];
+    memaddr_t text_start;         // span of the executable segments
+    memaddr_t text_size;
+    uint64_t *text_written;       // bitmap of text lines any lane wrote to
+} lanes_t;
+
+unsigned int lanes_add(lanes_t *lanes, FILE *elffile, int console_fd);
+void lanes_written(lanes_t *lanes, memaddr_t address, memaddr_t size);
+void lanes_run(lanes_t *lanes);
+void lanes_clear(lanes_t *lanes);
+
+#endif // _lanes_h_
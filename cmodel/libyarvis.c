@@ -0,0 +1,165 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mem.h"
+#include "dev.h"
+#include "replay.h"
+#include "aot.h"
+#include "sim.h"
+#include "libyarvis.h"
+
+extern void yarvis_reset(void);
+
+struct libyarvis {
+    sim_t sim;
+    libyarvis_retirement_t *trace;
+    size_t count; // retirements so far in this libyarvis_step() call
+    size_t limit;
+};
+
+static bool loaded;
+
+// Copies one retirement into the caller's trace, and stops the run once
+// the requested number have retired.
+static bool yarvis_retired(sim_t *sim, memword_t pc, const replay_entry_t *entry) {
+    libyarvis_t *yarvis = sim->context;
+    if (yarvis->trace) {
+        libyarvis_retirement_t *out = yarvis->trace + yarvis->count;
+        memset(out, 0, sizeof(*out));
+        out->pc = pc;
+        out->next_pc = entry->next_pc;
+        out->rd = entry->rd;
+        out->rd_value = entry->rd_value;
+        out->num_stores = entry->journal.count;
+        for (unsigned int i = 0; i < entry->journal.count; i++) {
+            out->stores[i].address = entry->journal.writes[i].address;
+            out->stores[i].size = entry->journal.writes[i].size;
+            out->stores[i].data = entry->journal.writes[i].data;
+        }
+        out->cycle = sim->time;
+    }
+    return ++yarvis->count < yarvis->limit;
+}
+
+unsigned int libyarvis_api_version(void) {
+    return LIBYARVIS_API_VERSION;
+}
+
+libyarvis_t *libyarvis_load(const char *elf_path, const char *console_path) {
+    int console_fd = STDOUT_FILENO;
+    FILE *elffile;
+    libyarvis_t *yarvis;
+
+    if (loaded) {
+        fprintf(stderr, "libyarvis_load: an instance is already open\n");
+        return NULL;
+    }
+    if (!(elffile = fopen(elf_path, "r"))) {
+        perror(elf_path);
+        return NULL;
+    }
+    if (console_path && ((console_fd = open(console_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)) {
+        perror(console_path);
+        fclose(elffile);
+        return NULL;
+    }
+
+    yarvis = calloc(1, sizeof(libyarvis_t));
+    CHECK(yarvis);
+    yarvis->sim.mem = mem_loadelf(elffile);
+    fclose(elffile);
+    yarvis->sim.regs = calloc(1, sizeof(regfile_t));
+    CHECK(yarvis->sim.regs);
+    yarvis->sim.pc = yarvis->sim.mem->entry_point;
+    yarvis->sim.retire = yarvis_retired;
+    yarvis->sim.context = yarvis;
+    console_map(yarvis->sim.mem, &yarvis->sim.console, console_fd);
+    sysctl_map(yarvis->sim.mem, &yarvis->sim.sysctl, &yarvis->sim.time);
+    mem_journal(yarvis->sim.mem, &yarvis->sim.journal);
+    yarvis_reset(); // in case the last instance stopped part-way through an instruction
+    loaded = true;
+    return yarvis;
+}
+
+size_t libyarvis_step(libyarvis_t *yarvis, size_t count, libyarvis_retirement_t *trace, uint64_t max_cycles) {
+    sim_t *sim = &yarvis->sim;
+    if (!count || sim->tohost || sim->sysctl.exited) {
+        return 0;
+    }
+    yarvis->trace = trace;
+    yarvis->count = 0;
+    yarvis->limit = count;
+    sim_run(sim, max_cycles ? sim->time + max_cycles : 0);
+    console_flush(&sim->console);
+    return yarvis->count;
+}
+
+void libyarvis_read_state(libyarvis_t *yarvis, libyarvis_state_t *state) {
+    const sim_t *sim = &yarvis->sim;
+    memset(state, 0, sizeof(*state));
+    state->pc = sim->pc;
+    for (unsigned int i = 0; i < NUM_REGS; i++) {
+        state->regs[i] = (*sim->regs)[i];
+    }
+    state->cycles = sim->time;
+    state->instret = sim->csrs.minstret;
+    state->tohost = sim->tohost;
+    state->done = sim->tohost || sim->sysctl.exited;
+    state->status = sim->sysctl.status;
+}
+
+int libyarvis_lookup(libyarvis_t *yarvis, const char *symbol, uint32_t *address) {
+    memaddr_t value;
+    if (!mem_lookup_symbol(yarvis->sim.mem, symbol, &value)) {
+        return -1;
+    }
+    *address = value;
+    return 0;
+}
+
+// Returns true if every word of the range is mapped, checked before any
+// of it is accessed.
+static bool libyarvis_mapped(const libyarvis_t *yarvis, uint32_t address, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if ((address + 4 * i < address) || !mem_mapped(yarvis->sim.mem, address + 4 * i, 4)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int libyarvis_poke(libyarvis_t *yarvis, uint32_t address, const uint32_t *words, size_t count) {
+    if (!libyarvis_mapped(yarvis, address, count)) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        mem_poke(yarvis->sim.mem, address + 4 * i, 4, words[i]);
+    }
+    return 0;
+}
+
+int libyarvis_peek(libyarvis_t *yarvis, uint32_t address, uint32_t *words, size_t count) {
+    if (!libyarvis_mapped(yarvis, address, count)) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        words[i] = mem_peek(yarvis->sim.mem, address + 4 * i, 4);
+    }
+    return 0;
+}
+
+void libyarvis_close(libyarvis_t *yarvis) {
+    console_flush(&yarvis->sim.console);
+    if (yarvis->sim.console.fd != STDOUT_FILENO) {
+        close(yarvis->sim.console.fd);
+    }
+    mem_destroy(yarvis->sim.mem);
+    reg_destroy(yarvis->sim.regs);
+    free(yarvis);
+    loaded = false;
+}
@@ -0,0 +1,73 @@
+#ifndef _libyarvis_h_
+#define _libyarvis_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Embedding API of libyarvis.so, for testbenches that use the model as a
+// golden reference. Only fixed-width types cross this boundary, and the
+// layout of the structs below only changes together with
+// LIBYARVIS_API_VERSION.
+//
+// The model keeps its FSM state in static storage, so a process can have
+// only one instance open at a time.
+
+#define LIBYARVIS_API_VERSION 1
+
+// The library is built with hidden visibility; only this API is exported.
+#define LIBYARVIS_API __attribute__((visibility("default")))
+
+#define LIBYARVIS_NUM_REGS 32
+#define LIBYARVIS_MAX_STORES 4
+
+typedef struct libyarvis libyarvis_t;
+
+// One retired instruction
+typedef struct {
+    uint32_t pc;        // of the instruction
+    uint32_t next_pc;
+    uint32_t rd;        // register it changed, or 0
+    uint32_t rd_value;
+    uint32_t num_stores;
+    struct {
+        uint32_t address;
+        uint32_t size;
+        uint32_t data;
+    } stores[LIBYARVIS_MAX_STORES];
+    uint64_t cycle;     // in which it retired
+} libyarvis_retirement_t;
+
+typedef struct {
+    uint32_t pc;
+    uint32_t regs[LIBYARVIS_NUM_REGS]; // x16-x31 read as 0 in RV32E builds
+    uint64_t cycles;
+    uint64_t instret;
+    uint32_t tohost;
+    uint32_t done;      // the guest wrote tohost or the sysctl exit register
+    uint32_t status;    // written to the sysctl exit register
+} libyarvis_state_t;
+
+LIBYARVIS_API unsigned int libyarvis_api_version(void);
+
+// Loads an ELF. Console output goes to `console_path`, or to stdout if it
+// is NULL. Returns NULL if a file cannot be opened or an instance is open.
+LIBYARVIS_API libyarvis_t *libyarvis_load(const char *elf_path, const char *console_path);
+
+// Runs until `count` more instructions have retired, recording each in
+// `trace` (if not NULL), or until the guest is done or `max_cycles` more
+// cycles have elapsed (0 for no limit). Returns the number retired.
+LIBYARVIS_API size_t libyarvis_step(libyarvis_t *yarvis, size_t count, libyarvis_retirement_t *trace, uint64_t max_cycles);
+
+LIBYARVIS_API void libyarvis_read_state(libyarvis_t *yarvis, libyarvis_state_t *state);
+
+// Resolves a symbol such as "tohost". Returns 0, or -1 if it is unknown.
+LIBYARVIS_API int libyarvis_lookup(libyarvis_t *yarvis, const char *symbol, uint32_t *address);
+
+// Word accesses to RAM or devices, as if made by the guest. Return 0, or
+// -1 without accessing anything if a word is misaligned or unmapped.
+LIBYARVIS_API int libyarvis_poke(libyarvis_t *yarvis, uint32_t address, const uint32_t *words, size_t count);
+LIBYARVIS_API int libyarvis_peek(libyarvis_t *yarvis, uint32_t address, uint32_t *words, size_t count);
+
+LIBYARVIS_API void libyarvis_close(libyarvis_t *yarvis);
+
+#endif // _libyarvis_h_
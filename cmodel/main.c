@@ -1,87 +1,576 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include "mem.h"
+#include "dev.h"
+#include "replay.h"
+#include "aot.h"
+#include "sim.h"
+#include "activity.h"
+#include "riscv.h"
+#include "coverage.h"
+#include "lanes.h"
 
-extern memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc);
+extern unsigned int yarvis_mul_latency;
+extern unsigned int yarvis_div_latency;
+
+#if ACTIVITY
+extern const char *const yarvis_state_names[];
+extern const unsigned int yarvis_num_states;
+#endif
 
 static inline void usage(void) {
     fprintf(stderr, "Usage: yarvis [-h] [-v] "
                     "[-s output.signature] "
                     "[-g signature_granularity] "
                     "[-n num_cycles] "
+                    "[-m mul_cycles[,div_cycles]] "
+                    "[-H num_harts [-Q quantum_cycles]] "
+                    "[-c console.txt] "
+                    "[-f fast_forward_cycles -S server.sock] "
+                    "[-r record.log | -R replay.log [-X instruction]] "
+                    "[-A aot_cache_dir] "
+                    "[-p activity.txt] "
+                    "[-C coverage.bin] "
+                    "[-L batch.txt] "
+                    "[-w address|symbol[+size][:r|:w|:rw][:stop]]... "
                     "-e input.elf\n");
 }
 
+static bool parse_address(const mem_t *mem, const char *token, memaddr_t *address) {
+    char *end;
+    if (mem_lookup_symbol(mem, token, address)) {
+        return true;
+    }
+    *address = strtoul(token, &end, 0);
+    return *token && !*end;
+}
+
+// Writes the words that follow <address|symbol> in a poke request, and sets
+// [*start, *start + *size) to the bytes written. Returns NULL, or what is
+// wrong with the request: every word is checked before it is written, so a
+// bad request stops there rather than aborting the model. Like the guest's
+// own inputs, the words are neither journaled nor watched.
+static const char *parse_poke(mem_t *mem, char **saveptr, memaddr_t *start, memaddr_t *size) {
+    char *end, *token = strtok_r(NULL, " \t\r\n", saveptr);
+    memaddr_t address;
+    *size = 0;
+    if (!token || !parse_address(mem, token, &address)) {
+        return "bad address";
+    }
+    *start = address;
+    while ((token = strtok_r(NULL, " \t\r\n", saveptr))) {
+        unsigned long word = strtoul(token, &end, 0);
+        if (!*token || *end || (word != (uint32_t)word)) {
+            return "bad word";
+        } else if (address % 4) {
+            return "misaligned address";
+        } else if (!mem_mapped(mem, address, 4)) {
+            return "unmapped address";
+        }
+        mem_poke(mem, address, 4, word);
+        address += 4;
+        *size += 4;
+    }
+    return NULL;
+}
+
+// Parses the optional count that follows "run", leaving *count as it is if
+// there is none. Returns NULL, or what is wrong with it.
+static const char *parse_run(char **saveptr, unsigned long *count) {
+    char *end, *token = strtok_r(NULL, " \t\r\n", saveptr);
+    if (token) {
+        *count = strtoul(token, &end, 0);
+        if (!*token || *end) {
+            return "bad count";
+        }
+    }
+    return NULL;
+}
+
+// Parses <address|symbol>[+size][:r|:w|:rw][:stop] and sets the watchpoint.
+// The size defaults to that of the symbol, or to one word.
+static bool parse_watch(sim_t *sim, char *spec) {
+    char *saveptr, *end, *token, *range = strtok_r(spec, ":", &saveptr);
+    char *plus = range ? strchr(range, '+') : NULL;
+    memaddr_t address, size = 4;
+    unsigned int access = WATCH_WRITE;
+    bool stop = false;
+
+    if (plus) {
+        *plus = '\0';
+        size = strtoul(plus + 1, &end, 0);
+        if (!size || *end) {
+            return false;
+        }
+    }
+    if (!range || !parse_address(sim->mem, range, &address)) {
+        return false;
+    }
+    if (!plus) {
+        const memsymbol_t *symbol = mem_symbol_at(sim->mem, address);
+        if (symbol && (symbol->address == address) && symbol->size) {
+            size = symbol->size;
+        }
+    }
+    while ((token = strtok_r(NULL, ":", &saveptr))) {
+        if (!strcmp(token, "r")) {
+            access = WATCH_READ;
+        } else if (!strcmp(token, "w")) {
+            access = WATCH_WRITE;
+        } else if (!strcmp(token, "rw")) {
+            access = WATCH_READ | WATCH_WRITE;
+        } else if (!strcmp(token, "stop")) {
+            stop = true;
+        } else {
+            return false;
+        }
+    }
+    sim_watch(sim, range, address, size, access, stop);
+    return true;
+}
+
+// Serves one fork-server connection in a freshly forked child. The request
+// is a sequence of text lines:
+//     poke <address|symbol> <word> [<word>...]
+//     run [num_cycles]
+// and the reply is
+//     status <exit_status> tohost <value> cycles <n>
+//     <signature words, one per line>
+//     end
+// or, for a bad request, "error <reason>".
+static void serve_child(sim_t *sim, int fd, unsigned long num_cycles, unsigned int granularity) {
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    char line[1024];
+    CHECK(in && out);
+
+    while (fgets(line, sizeof(line), in)) {
+        char *saveptr, *command = strtok_r(line, " \t\r\n", &saveptr);
+        const char *error;
+        memaddr_t address, size;
+        if (!command) {
+            continue;
+        } else if (!strcmp(command, "poke")) {
+            if ((error = parse_poke(sim->mem, &saveptr, &address, &size))) {
+                fprintf(out, "error %s\n", error);
+                break;
+            }
+        } else if (!strcmp(command, "run")) {
+            if ((error = parse_run(&saveptr, &num_cycles))) {
+                fprintf(out, "error %s\n", error);
+                break;
+            }
+            sim_run(sim, num_cycles ? sim->time + num_cycles : 0);
+            console_flush(&sim->console);
+            fprintf(out, "status %u tohost %#x cycles %lu\n",
+                    sim->sysctl.exited ? sim->sysctl.status : 0, sim->tohost, sim->time);
+            mem_dump_signature(sim->mem, out, granularity);
+            fprintf(out, "end\n");
+            break;
+        } else {
+            fprintf(out, "error unknown command %s\n", command);
+            break;
+        }
+    }
+    fclose(out);
+    fclose(in);
+}
+
+// Loads once, then forks a copy-on-write child per connection so that
+// every run starts from the same (possibly fast-forwarded) state.
+static int serve(sim_t *sim, const char *path, unsigned long num_cycles, unsigned int granularity) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((listener < 0) || (strlen(path) >= sizeof(addr.sun_path))) {
+        perror(path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, SOMAXCONN)) {
+        perror(path);
+        return 1;
+    }
+    signal(SIGCHLD, SIG_IGN); // children are reaped automatically
+    console_flush(&sim->console);
+    fflush(NULL);
+
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            perror("accept");
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listener);
+            serve_child(sim, fd, num_cycles, granularity);
+            _exit(0);
+        }
+        if (pid < 0) {
+            perror("fork");
+        }
+        close(fd);
+    }
+}
+
+// Runs a batch of instances, one per lane, and replies for each in turn
+static void lanes_reply(lanes_t *lanes, unsigned int granularity, unsigned long *instructions) {
+    lanes_run(lanes);
+    for (unsigned int i = 0; i < lanes->count; i++) {
+        console_flush(&lanes->console[i]);
+        printf("status %u tohost %#x instret %lu\n", lanes->sysctl[i].exited ? lanes->sysctl[i].status : 0,
+               lanes->tohost[i], (unsigned long)lanes->retired[i]);
+        mem_dump_signature(lanes->mem[i], stdout, granularity);
+        printf("end\n");
+        *instructions += lanes->retired[i];
+    }
+    lanes_clear(lanes);
+}
+
+// Runs the instances that `in` describes in the fork server's request
+// format, one "poke ... run" sequence each, LANES at a time. Replies are
+// written to stdout in the same order and format as the server's, with the
+// instructions retired in place of the cycles: lanes do not model time.
+static bool serve_lanes(lanes_t *lanes, FILE *elffile, FILE *in, int console_fd, unsigned long num_cycles,
+                        unsigned int granularity, bool verbose) {
+    unsigned long instances = 0, instructions = 0;
+    bool started = false;
+    char line[1024];
+
+    while (fgets(line, sizeof(line), in)) {
+        char *saveptr, *command = strtok_r(line, " \t\r\n", &saveptr);
+        const char *error;
+        memaddr_t address, size;
+        if (!command) {
+            continue;
+        }
+        if (!started) {
+            lanes->limit[lanes_add(lanes, elffile, console_fd)] = num_cycles;
+            started = true;
+            instances++;
+        }
+        unsigned int i = lanes->count - 1;
+        if (!strcmp(command, "poke")) {
+            if ((error = parse_poke(lanes->mem[i], &saveptr, &address, &size))) {
+                fprintf(stderr, "Poke in instance %lu: %s\n", instances - 1, error);
+                return false;
+            }
+            lanes_written(lanes, address, size);
+        } else if (!strcmp(command, "run")) {
+            unsigned long limit = lanes->limit[i];
+            if ((error = parse_run(&saveptr, &limit))) {
+                fprintf(stderr, "Run in instance %lu: %s\n", instances - 1, error);
+                return false;
+            }
+            lanes->limit[i] = limit;
+            started = false;
+            if (lanes->count == LANES) {
+                lanes_reply(lanes, granularity, &instructions);
+            }
+        } else {
+            fprintf(stderr, "Unknown command %s in instance %lu\n", command, instances - 1);
+            return false;
+        }
+    }
+    if (lanes->count) {
+        lanes_reply(lanes, granularity, &instructions);
+    }
+    if (verbose && lanes->issued) {
+        fprintf(stderr, "Lanes: %lu instances, %lu instructions in %lu issue groups, %.2f lanes/group\n",
+                instances, instructions, (unsigned long)lanes->issued, (double)instructions / lanes->issued);
+    }
+    return true;
+}
+
 int main(int argc, char *argv[]) {
     int ch, verbose = 0;
+    char *end;
     FILE *elffile = NULL;
     FILE *sigfile = NULL;
+    const char *server_path = NULL;
+    int console_fd = STDOUT_FILENO;
     unsigned int signature_granularity = 4;
     unsigned long num_cycles = 0;
-    mem_t *mem;
-    regfile_t *regs;
-    memword_t pc;
-
+    unsigned long fast_forward = 0;
+    FILE *replayfile = NULL;
+    bool seek = false;
+    unsigned long seek_index = 0;
+    const char *aot_dir = NULL;
+    FILE *activityfile = NULL;
+    FILE *coveragefile = NULL;
+    FILE *batchfile = NULL;
+    char *watches[MAX_WATCHES];
+    unsigned int num_watches = 0;
+    unsigned int num_harts = 1;
+    unsigned long quantum = 1000;
+    sim_t *harts[MAX_HARTS] = { NULL };
+    static activity_t activity;
+    static coverage_t coverage;
+    static sim_t sim;
+    static lanes_t lanes;
 
-    while ((ch = getopt(argc, argv, "e:g:hn:s:v")) != -1) {
+    while ((ch = getopt(argc, argv, "A:c:C:e:f:g:hH:L:m:n:p:Q:r:R:s:S:vw:X:")) != -1) {
         switch (ch) {
+            case 'A':
+                aot_dir = optarg;
+                break;
+            case 'c':
+                if ((console_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'C':
+                if (!(coveragefile = fopen(optarg, "wb"))) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
             case 'e':
                 if (!(elffile = fopen(optarg, "r"))) {
                     perror(optarg);
                     return 1;
                 }
                 break;
+            case 'f':
+                fast_forward = strtoul(optarg, NULL, 0);
+                break;
             case 'g':
                 signature_granularity = strtoul(optarg, NULL, 0);
                 break;
             case 'h':
                 usage();
                 return 0;
+            case 'H':
+                num_harts = strtoul(optarg, &end, 0);
+                if (*end || !num_harts || (num_harts > MAX_HARTS)) {
+                    fprintf(stderr, "Between 1 and %d harts\n", MAX_HARTS);
+                    return 1;
+                }
+                break;
+            case 'L':
+                if (!(batchfile = fopen(optarg, "r"))) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                // Latency of the iterative multiplier, and of the divider if different
+                yarvis_mul_latency = yarvis_div_latency = strtoul(optarg, &end, 0);
+                if (*end == ',') {
+                    yarvis_div_latency = strtoul(end + 1, &end, 0);
+                }
+                if (*end) {
+                    usage();
+                    return 1;
+                }
+                break;
             case 'n':
                 num_cycles = strtoul(optarg, NULL, 0);
                 break;
+            case 'p':
+#if ACTIVITY
+                if (!(activityfile = fopen(optarg, "w"))) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+#else
+                fprintf(stderr, "-p requires a build with ACTIVITY=1\n");
+                return 1;
+#endif
+            case 'Q':
+                quantum = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+            case 'R':
+                if (!(replayfile = fopen(optarg, (ch == 'r') ? "wb" : "rb"))) {
+                    perror(optarg);
+                    return 1;
+                }
+                sim.verify = (ch == 'R');
+                break;
             case 's':
                 if (!(sigfile = fopen(optarg, "w"))) {
                     perror(optarg);
                     return 1;
                 }
                 break;
+            case 'S':
+                server_path = optarg;
+                break;
             case 'v':
                 verbose = 1;
                 break;
+            case 'w':
+                if (num_watches == MAX_WATCHES) {
+                    fprintf(stderr, "At most %d watchpoints\n", MAX_WATCHES);
+                    return 1;
+                }
+                watches[num_watches++] = optarg;
+                break;
+            case 'X':
+                seek = true;
+                seek_index = strtoul(optarg, NULL, 0);
+                break;
             default:
                 usage();
                 return 1;
         }
     }
 
-    if (!elffile) {
+    if (!elffile || (fast_forward && !server_path) || (replayfile && server_path)
+        || (seek && !sim.verify) || (aot_dir && (replayfile || num_watches))
+        || ((activityfile || coveragefile) && (aot_dir || server_path))
+        || ((num_harts > 1) && (replayfile || aot_dir || activityfile || coveragefile || server_path
+                                || num_watches || !quantum))
+        || (batchfile && (server_path || replayfile || aot_dir || activityfile || coveragefile || sigfile
+                          || num_watches || (num_harts > 1)))) {
         usage();
         return 1;
     }
 
-    mem = mem_loadelf(elffile);
+    if (batchfile) {
+        // Console output would interleave with the replies on stdout
+        if ((console_fd == STDOUT_FILENO) && ((console_fd = open("/dev/null", O_WRONLY)) < 0)) {
+            perror("/dev/null");
+            return 1;
+        }
+        bool ok = serve_lanes(&lanes, elffile, batchfile, console_fd, num_cycles, signature_granularity, verbose);
+        fclose(batchfile);
+        fclose(elffile);
+        return ok ? 0 : 1;
+    }
+
+    sim.mem = mem_loadelf(elffile);
+    if (aot_dir) {
+        sim.aot = aot_load(sim.mem, elffile, aot_dir);
+    }
     fclose(elffile);
-    regs = calloc(1, sizeof(regfile_t));
-    pc = mem->entry_point;
-    unsigned long time;
+    sim.regs = calloc(1, sizeof(regfile_t));
+    sim.pc = sim.mem->entry_point;
+    console_map(sim.mem, &sim.console, console_fd);
+    sysctl_map(sim.mem, &sim.sysctl, &sim.time);
+    for (unsigned int i = 0; i < num_watches; i++) {
+        if (!parse_watch(&sim, watches[i])) {
+            fprintf(stderr, "Bad watchpoint: %s\n", watches[i]);
+            return 1;
+        }
+    }
 
-    for (time = 0; (num_cycles == 0) || (num_cycles > time); time++) {
-        pc = yarvis_step(mem, regs, pc);
-        if ((ch = mem_read(mem, mem->symbols[SYM_TOHOST], 4))) {
-            break;
+    if (seek) {
+        // Reconstruct the state from the log alone, without executing
+        sim.replay = replay_open(replayfile);
+        fclose(replayfile);
+        replay_seek(sim.replay, seek_index, sim.mem);
+        memcpy(sim.regs, sim.replay->regs, sizeof(regfile_t));
+        fprintf(stderr, "Instruction %lu: pc=%#x\n", seek_index, sim.replay->pc);
+        reg_describe(sim.regs);
+        if (sigfile) {
+            mem_dump_signature(sim.mem, sigfile, signature_granularity);
+            fclose(sigfile);
         }
+        replay_close(sim.replay);
+        return 0;
+    }
+#if ACTIVITY
+    if (activityfile) {
+        activity_attach(&activity, sim.mem, yarvis_state_names, yarvis_num_states);
+        yarvis_activity = &activity;
+    }
+#endif
+    if (coveragefile) {
+        yarvis_coverage = &coverage;
+    }
+    if (replayfile) {
+        if (sim.verify) {
+            sim.replay = replay_open(replayfile);
+            fclose(replayfile);
+            CHECK(sim.replay->entry_point == sim.pc);
+        } else {
+            sim.replay = replay_create(replayfile, sim.pc);
+        }
+        mem_journal(sim.mem, &sim.journal);
     }
 
-    if (verbose) {
-        fprintf(stderr, "Finished: t=%lu pc=%#x .tohost=%#x\n", time, pc - 4, ch);
-        reg_describe(regs);
+    if (server_path) {
+        if (fast_forward && sim_run(&sim, fast_forward)) {
+            fprintf(stderr, "Finished during fast-forward: t=%lu\n", sim.time);
+            return 1;
+        }
+        return serve(&sim, server_path, num_cycles, signature_granularity);
+    }
+
+    // Harts other than 0 share its memory and devices
+    harts[0] = &sim;
+    for (unsigned int i = 1; i < num_harts; i++) {
+        harts[i] = calloc(1, sizeof(sim_t));
+        CHECK(harts[i]);
+        harts[i]->mem = sim.mem;
+        harts[i]->regs = calloc(1, sizeof(regfile_t));
+        harts[i]->pc = sim.mem->entry_point;
+        harts[i]->csrs.mhartid = i;
+        harts[i]->primary = &sim;
+    }
+    if (num_harts > 1) {
+        sim_run_harts(harts, num_harts, num_cycles, quantum);
+    } else {
+        sim_run(&sim, num_cycles);
+    }
+    if (sim.replay) {
+        if (sim.verify && !sim.diverged && (sim.replay->count != sim.replay->total)) {
+            fprintf(stderr, "Divergence at instruction %lu: log continues\n",
+                    (unsigned long)sim.replay->count);
+            sim.diverged = true;
+        }
+        replay_close(sim.replay);
+    }
+    if (sim.aot) {
+        aot_destroy(sim.aot);
+    }
+
+    console_flush(&sim.console);
+    for (unsigned int i = 0; verbose && (i < num_harts); i++) {
+        const sim_t *hart = harts[i];
+        if (num_harts > 1) {
+            fprintf(stderr, "Hart %u:\n", i);
+        }
+        fprintf(stderr, "Finished: t=%lu idle=%lu pc=%#x .tohost=%#x\n",
+                hart->time, hart->idle, sim_last_pc(hart), sim.tohost);
+        if (hart->csrs.minstret) {
+            // Each 16-bit parcel is one bus cycle on the chip's narrow bus
+            double per_instruction = (double)hart->csrs.fetch_parcels / hart->csrs.minstret;
+            fprintf(stderr, "Fetched: %lu bytes in %lu bus cycles, %.2f bytes and %.2f bus cycles/instruction\n",
+                    (unsigned long)(2 * hart->csrs.fetch_parcels), (unsigned long)hart->csrs.fetch_parcels,
+                    2 * per_instruction, per_instruction);
+        }
+        reg_describe(hart->regs);
     }
     if (sigfile) {
-        mem_dump_signature(mem, sigfile, signature_granularity);
+        mem_dump_signature(sim.mem, sigfile, signature_granularity);
         fclose(sigfile);
     }
-    return 0;
+    if (activityfile) {
+        activity_report(&activity, activityfile);
+        activity_destroy(&activity);
+        fclose(activityfile);
+    }
+    if (coveragefile) {
+        coverage_write(&coverage, coveragefile);
+        fclose(coveragefile);
+    }
+    if (sim.diverged || sim.stopped) {
+        return 1;
+    }
+    return sim.sysctl.exited ? (int)sim.sysctl.status : 0;
 }
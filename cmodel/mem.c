@@ -1,12 +1,13 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "elf.h"
 #include "mem.h"
-
-#undef NDEBUG // FIXME: HACK: assertions in this file are load-bearing
-#include <assert.h>
+#include "riscv.h"
 
 static const char elf32le_magic[EI_NIDENT] = {
     0x7f, 'E', 'L', 'F', ELFCLASS32, ELFDATA2LSB, EV_CURRENT, 0x0,
@@ -20,53 +21,113 @@ static const char *const symbol_names[NUM_SYMS] = {
     "tohost",
 };
 
+static int memsymbol_compar(const void *a, const void *b) {
+    const memsymbol_t *sa = a, *sb = b;
+    return (sa->address > sb->address) - (sa->address < sb->address);
+}
+
+static uint64_t *clint_search(clint_t *clint, memaddr_t offset, memaddr_t size) {
+    CHECK((size == 4) && !(offset % size));
+    if (offset - CLINT_MTIMECMP < sizeof(clint->mtimecmp)) {
+        return clint->mtimecmp + ((offset - CLINT_MTIMECMP) >> 3);
+    }
+    CHECK((offset & ~7) == CLINT_MTIME); // unmapped CLINT register
+    return &clint->mtime;
+}
+
+static memword_t clint_read(void *context, memaddr_t offset, memaddr_t size) {
+    return clint_load(clint_search(context, offset, size)) >> ((offset & 4) * 8);
+}
+
+// Devices are written under a lock, so only hart 0 advancing mtime can come
+// between the load and the store, and its cycles are then lost, as they
+// would be on a write of mtime a moment later.
+static void clint_write(void *context, memaddr_t offset, memaddr_t size, memword_t data) {
+    uint64_t *reg = clint_search(context, offset, size);
+    unsigned int shift = (offset & 4) * 8;
+    uint64_t value = (clint_load(reg) & ~((uint64_t)UINT32_MAX << shift)) | ((uint64_t)data << shift);
+    __atomic_store_n(reg, value, __ATOMIC_RELAXED);
+}
+
+// Publishes every page that lies entirely inside one RAM region to the page
+// table. This is where RAM accesses are validated: a page is only mapped
+// once its bounds are known to be good, so aligned accesses through the
+// table need no further checks. Pages straddling a region boundary are left
+// unmapped and take the checked path through mem_search().
+static void mem_map_pages(mem_t *mem) {
+    mem->pages = calloc(NUM_PAGES, sizeof(*mem->pages));
+    CHECK(mem->pages);
+    for (unsigned int i = 0; i < mem->num_regions; i++) {
+        memregion_t *region = mem->regions + i;
+        memaddr_t first = (region->address + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        memaddr_t last = (region->address + region->size) >> PAGE_SHIFT;
+        for (memaddr_t page = first; (page < last) && (page < NUM_PAGES); page++) {
+            mem->pages[page] = (uint8_t *)region->data + ((page << PAGE_SHIFT) - region->address);
+        }
+    }
+    mem->write_pages = mem->pages;
+}
+
 mem_t *mem_loadelf(FILE *fh) {
     mem_t *mem;
     Elf32_Ehdr ehdr;
 
-    assert(!fseek(fh, 0, SEEK_SET));
-    assert(fread(&ehdr, sizeof(ehdr), 1, fh));
-    assert(!memcmp(ehdr.e_ident, elf32le_magic, EI_NIDENT));
-    assert(ehdr.e_type == ET_EXEC);
-    assert(ehdr.e_machine == EM_RISCV);
-    assert(ehdr.e_version == EV_CURRENT);
-    assert(ehdr.e_ehsize == sizeof(ehdr));
-    assert(ehdr.e_phentsize == sizeof(Elf32_Phdr));
-    assert(ehdr.e_shentsize == sizeof(Elf32_Shdr));
+    CHECK(!fseek(fh, 0, SEEK_SET));
+    CHECK(fread(&ehdr, sizeof(ehdr), 1, fh));
+    CHECK(!memcmp(ehdr.e_ident, elf32le_magic, EI_NIDENT));
+    CHECK(ehdr.e_type == ET_EXEC);
+    CHECK(ehdr.e_machine == EM_RISCV);
+    CHECK(ehdr.e_version == EV_CURRENT);
+    CHECK(ehdr.e_ehsize == sizeof(ehdr));
+    CHECK(ehdr.e_phentsize == sizeof(Elf32_Phdr));
+    CHECK(ehdr.e_shentsize == sizeof(Elf32_Shdr));
     mem = calloc(1, sizeof(mem_t) + ehdr.e_phnum * sizeof(memregion_t));
-    assert(mem);
-    assert(ehdr.e_entry);
+    CHECK(mem);
+    CHECK(ehdr.e_entry);
     mem->entry_point = ehdr.e_entry;
-    assert(mem->entry_point);
+    CHECK(mem->entry_point);
+    for (unsigned int i = 0; i < MAX_HARTS; i++) {
+        mem->clint.mtimecmp[i] = UINT64_MAX;
+    }
 
     for (int segment = 0; segment < ehdr.e_phnum; segment++) {
         Elf32_Phdr phdr;
         memaddr_t alignment;
         memregion_t *region = mem->regions + mem->num_regions;
 
-        assert(!fseek(fh, ehdr.e_phoff + segment * ehdr.e_phentsize, SEEK_SET));
-        assert(fread(&phdr, sizeof(phdr), 1, fh));
+        CHECK(!fseek(fh, ehdr.e_phoff + segment * ehdr.e_phentsize, SEEK_SET));
+        CHECK(fread(&phdr, sizeof(phdr), 1, fh));
         if ((phdr.p_type != PT_LOAD) || (phdr.p_memsz == 0)) {
             continue;
         }
         if (mem->num_regions) {
-            assert(phdr.p_vaddr >= (region - 1)->address + (region - 1)->size);
+            CHECK(phdr.p_vaddr >= (region - 1)->address + (region - 1)->size);
         }
         region->address = phdr.p_vaddr;
-        assert(region->address);
-        assert(phdr.p_memsz >= phdr.p_filesz);
-        assert(!(phdr.p_align & (phdr.p_align - 1)));
+        CHECK(region->address);
+        CHECK(phdr.p_memsz >= phdr.p_filesz);
+        CHECK(!(phdr.p_align & (phdr.p_align - 1)));
         alignment = (phdr.p_align > sizeof(void *)) ? phdr.p_align : sizeof(void *);
         region->size = phdr.p_align
             * ((phdr.p_memsz / alignment) + ((phdr.p_memsz % alignment) ? 1 : 0));
         region->data = aligned_alloc(alignment, region->size);
-        assert(region->data);
-        assert(!fseek(fh, phdr.p_offset, SEEK_SET));
-        assert(fread(region->data, phdr.p_filesz, 1, fh));
+        CHECK(region->data);
+        region->executable = phdr.p_flags & PF_X;
+        CHECK(!fseek(fh, phdr.p_offset, SEEK_SET));
+        CHECK(fread(region->data, phdr.p_filesz, 1, fh));
         memset((uint8_t *)region->data + phdr.p_filesz, 0, region->size - phdr.p_filesz);
         mem->num_regions++;
     }
-    assert(mem->num_regions);
+    CHECK(mem->num_regions);
+    mem_map_pages(mem);
+    mem_map_device(mem, &(memdevice_t){
+        .name = "clint",
+        .address = CLINT_BASE,
+        .size = CLINT_SIZE,
+        .read = clint_read,
+        .write = clint_write,
+        .context = &mem->clint,
+    });
 
     for (int section = 0; section < ehdr.e_shnum; section++) {
         Elf32_Shdr symtab, strtab;
@@ -74,33 +135,45 @@ mem_t *mem_loadelf(FILE *fh) {
         char *strings;
         int num_symbols;
 
-        assert(!fseek(fh, ehdr.e_shoff + section * ehdr.e_shentsize, SEEK_SET));
-        assert(fread(&symtab, sizeof(symtab), 1, fh));
+        CHECK(!fseek(fh, ehdr.e_shoff + section * ehdr.e_shentsize, SEEK_SET));
+        CHECK(fread(&symtab, sizeof(symtab), 1, fh));
         if (symtab.sh_type != SHT_SYMTAB) {
             continue;
         }
-        assert(symtab.sh_entsize == sizeof(sym));
-        assert(symtab.sh_link && (symtab.sh_link < ehdr.e_shnum));
-        assert(!fseek(fh, ehdr.e_shoff + symtab.sh_link * ehdr.e_shentsize, SEEK_SET));
-        assert(fread(&strtab, sizeof(strtab), 1, fh));
-        assert(strtab.sh_type == SHT_STRTAB);
-        assert(!(symtab.sh_size % symtab.sh_entsize));
+        CHECK(symtab.sh_entsize == sizeof(sym));
+        CHECK(symtab.sh_link && (symtab.sh_link < ehdr.e_shnum));
+        CHECK(!fseek(fh, ehdr.e_shoff + symtab.sh_link * ehdr.e_shentsize, SEEK_SET));
+        CHECK(fread(&strtab, sizeof(strtab), 1, fh));
+        CHECK(strtab.sh_type == SHT_STRTAB);
+        CHECK(!(symtab.sh_size % symtab.sh_entsize));
         strings = malloc(strtab.sh_size);
-        assert(strings);
-        assert(!fseek(fh, strtab.sh_offset, SEEK_SET));
-        assert(fread(strings, strtab.sh_size, 1, fh));
+        CHECK(strings);
+        CHECK(!fseek(fh, strtab.sh_offset, SEEK_SET));
+        CHECK(fread(strings, strtab.sh_size, 1, fh));
+        CHECK(strtab.sh_size && !strings[strtab.sh_size - 1]);
 
         num_symbols = symtab.sh_size / symtab.sh_entsize;
+        mem->symtab = calloc(num_symbols, sizeof(memsymbol_t));
+        CHECK(mem->symtab);
         for (int symbol = 0; symbol < num_symbols; symbol++) {
             int maxlength;
 
-            assert(!fseek(fh, symtab.sh_offset + symbol * symtab.sh_entsize, SEEK_SET));
-            assert(fread(&sym, sizeof(sym), 1, fh));
+            CHECK(!fseek(fh, symtab.sh_offset + symbol * symtab.sh_entsize, SEEK_SET));
+            CHECK(fread(&sym, sizeof(sym), 1, fh));
+            if (sym.st_name && (sym.st_shndx != SHN_UNDEF) && (ELF32_ST_TYPE(sym.st_info) <= STT_FUNC)) {
+                CHECK(sym.st_name < strtab.sh_size);
+                mem->symtab[mem->num_symtab++] = (memsymbol_t){
+                    .name = strings + sym.st_name,
+                    .address = sym.st_value,
+                    .size = sym.st_size,
+                    .function = ELF32_ST_TYPE(sym.st_info) != STT_OBJECT,
+                };
+            }
             if (ELF32_ST_BIND(sym.st_info) != STB_GLOBAL) {
                 continue;
             }
             maxlength = strtab.sh_size - sym.st_name;
-            assert(maxlength);
+            CHECK(maxlength);
             for (int match = 0; match < NUM_SYMS; match++) {
                 if (!strncmp(strings + sym.st_name, symbol_names[match], maxlength)) {
                     mem->symbols[match] = sym.st_value;
@@ -108,12 +181,138 @@ mem_t *mem_loadelf(FILE *fh) {
                 }
             }
         }
-        free(strings);
+        qsort(mem->symtab, mem->num_symtab, sizeof(memsymbol_t), memsymbol_compar);
+        mem->strings = strings;
         break;
     }
     return mem;
 }
 
+bool mem_lookup_symbol(const mem_t *mem, const char *name, memaddr_t *address) {
+    for (int i = 0; i < NUM_SYMS; i++) {
+        if (mem->symbols[i] && !strcmp(name, symbol_names[i])) {
+            *address = mem->symbols[i];
+            return true;
+        }
+    }
+    for (unsigned int i = 0; i < mem->num_symtab; i++) {
+        if (!strcmp(name, mem->symtab[i].name)) {
+            *address = mem->symtab[i].address;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the symbol at or closest below `address`, or NULL if there is
+// none or the address lies beyond its known size.
+const memsymbol_t *mem_symbol_at(const mem_t *mem, memaddr_t address) {
+    unsigned int low = 0, high = mem->num_symtab;
+    const memsymbol_t *symbol;
+    while (low < high) {
+        unsigned int middle = low + (high - low) / 2;
+        if (mem->symtab[middle].address <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (!low) {
+        return NULL;
+    }
+    symbol = mem->symtab + low - 1;
+    return (!symbol->size || (address - symbol->address < symbol->size)) ? symbol : NULL;
+}
+
+void mem_map_device(mem_t *mem, const memdevice_t *device) {
+    assert(mem && device);
+    CHECK(mem->num_devices < MAX_DEVICES);
+    CHECK(device->size && device->read && device->write);
+    for (unsigned int i = 0; i < mem->num_regions; i++) {
+        const memregion_t *region = mem->regions + i;
+        CHECK((device->address >= region->address + region->size)
+               || (device->address + device->size <= region->address));
+    }
+    for (unsigned int i = 0; i < mem->num_devices; i++) {
+        const memdevice_t *other = mem->devices + i;
+        CHECK((device->address >= other->address + other->size)
+               || (device->address + device->size <= other->address));
+    }
+    mem->devices[mem->num_devices++] = *device;
+}
+
+// Attaches a journal that records every store (NULL to detach). While it is
+// attached, stores bypass the page table so the slow path sees them all.
+void mem_journal(mem_t *mem, memjournal_t *journal) {
+    assert(mem);
+    if (mem->write_pages != mem->pages) {
+        free(mem->write_pages);
+    }
+    mem->journal = journal;
+    mem->write_pages = journal ? calloc(NUM_PAGES, sizeof(*mem->write_pages)) : mem->pages;
+    CHECK(mem->write_pages);
+    // The new table does not route stores to reserved pages to the slow
+    // path, so drop the reservations: an SC may always fail
+    for (unsigned int i = 0; i < MAX_HARTS; i++) {
+        mem->reservations[i].valid = false;
+    }
+}
+
+// Gives the stores a page table of their own, which LR can edit
+static void mem_split_write_pages(mem_t *mem) {
+    if (mem->write_pages == mem->pages) {
+        mem->write_pages = malloc(NUM_PAGES * sizeof(*mem->write_pages));
+        CHECK(mem->write_pages);
+        memcpy(mem->write_pages, mem->pages, NUM_PAGES * sizeof(*mem->write_pages));
+    }
+}
+
+// Has devices and reservations take a lock while harts on other threads
+// share the memory. The store page table is split first, as it cannot be
+// swapped while they use it.
+void mem_share(mem_t *mem, bool shared) {
+    if (shared) {
+        mem_split_write_pages(mem);
+    }
+    mem->shared = shared;
+}
+
+// Adds a watchpoint. Its pages are removed from the page tables, so only
+// accesses to them take the slow path, where the page bitmap tells the
+// watched pages from the others in a single bit test.
+void mem_watch(mem_t *mem, const memwatch_t *watch) {
+    assert(mem && watch);
+    CHECK(mem->num_watches < MAX_WATCHES);
+    CHECK(watch->size && watch->access && watch->hit);
+    CHECK(watch->address + watch->size - 1 >= watch->address);
+    if (!mem->watched) {
+        mem->watched = calloc(NUM_PAGES / 64, sizeof(uint64_t));
+        CHECK(mem->watched);
+    }
+    for (memaddr_t page = watch->address >> PAGE_SHIFT;
+         page <= ((watch->address + watch->size - 1) >> PAGE_SHIFT); page++) {
+        mem->watched[page / 64] |= (uint64_t)1 << (page % 64);
+        mem->pages[page] = NULL;
+        mem->write_pages[page] = NULL;
+    }
+    mem->watches[mem->num_watches++] = *watch;
+}
+
+static void mem_watch_check(const mem_t *mem, unsigned int access, memaddr_t address, memaddr_t size,
+                            memword_t data) {
+    memaddr_t page = address >> PAGE_SHIFT;
+    if (!mem->watched || !((mem->watched[page / 64] >> (page % 64)) & 1)) {
+        return;
+    }
+    for (unsigned int i = 0; i < mem->num_watches; i++) {
+        const memwatch_t *watch = mem->watches + i;
+        if ((watch->access & access) && (address - watch->address < watch->size
+                                         || watch->address - address < size)) {
+            watch->hit(watch->context, access, address, size, data);
+        }
+    }
+}
+
 void mem_describe(mem_t *mem, FILE *fh) {
     assert(mem);
     fprintf(fh, "Entry point: %08x\n", mem->entry_point);
@@ -128,6 +327,11 @@ void mem_describe(mem_t *mem, FILE *fh) {
         fprintf(fh, "Region %d: addr %08x, size %08x, data %02x%02x%02x%02x...\n",
                 i, region->address, region->size, data[0], data[1], data[2], data[3]);
     }
+    for (unsigned int i = 0; i < mem->num_devices; i++) {
+        memdevice_t *device = mem->devices + i;
+        fprintf(fh, "Device %d: addr %08x, size %08x, %s\n",
+                i, device->address, device->size, device->name);
+    }
 }
 
 static int memregion_compar(const void *address, const void *region) {
@@ -137,18 +341,76 @@ static int memregion_compar(const void *address, const void *region) {
     return (addr < min_addr) ? -1 : (addr < max_addr) ? 0 : 1;
 }
 
+// Returns true if the address is RAM rather than a device or unmapped.
+bool mem_contains(const mem_t *mem, memaddr_t address) {
+    return bsearch(&address, mem->regions, mem->num_regions, sizeof(memregion_t), memregion_compar);
+}
+
+// Returns a pointer into RAM, or NULL if the address belongs to no region.
 static void *mem_search(const mem_t *mem, const memaddr_t address, memaddr_t size) {
     memregion_t *region;
     assert(mem);
-    assert((size > 0) && !(size & (size - 1)) && (size <= sizeof(memword_t)));
-    assert(!(address % size));
-    assert((region = bsearch(&address, mem->regions, mem->num_regions, sizeof(memregion_t), memregion_compar)));
-    assert(address + size <= region->address + region->size);
+    CHECK((size > 0) && !(size & (size - 1)) && (size <= sizeof(memword_t)));
+    CHECK(!(address % size));
+    region = bsearch(&address, mem->regions, mem->num_regions, sizeof(memregion_t), memregion_compar);
+    if (!region) {
+        return NULL;
+    }
+    CHECK(address + size <= region->address + region->size);
     return ((uint8_t *)region->data) + (address - region->address);
 }
 
-memword_t mem_read(const mem_t *mem, memaddr_t address, memaddr_t size) {
+static const memdevice_t *mem_find_device(const mem_t *mem, const memaddr_t address) {
+    for (unsigned int i = 0; i < mem->num_devices; i++) {
+        const memdevice_t *device = mem->devices + i;
+        if (address - device->address < device->size) {
+            return device;
+        }
+    }
+    return NULL;
+}
+
+// Only consulted once an access has missed every RAM region.
+static const memdevice_t *mem_search_device(const mem_t *mem, const memaddr_t address, memaddr_t size) {
+    const memdevice_t *device = mem_find_device(mem, address);
+    CHECK(device); // unmapped address
+    CHECK(address + size <= device->address + device->size);
+    return device;
+}
+
+// Returns true if an aligned access of `size` bytes at `address` falls
+// within RAM or a device, so that mem_peek() and mem_write() accept it.
+// For checking addresses that come from outside the guest.
+bool mem_mapped(const mem_t *mem, memaddr_t address, memaddr_t size) {
+    const memregion_t *region = bsearch(&address, mem->regions, mem->num_regions, sizeof(memregion_t),
+                                        memregion_compar);
+    const memdevice_t *device = region ? NULL : mem_find_device(mem, address);
+    if (address % size) {
+        return false;
+    } else if (region) {
+        return address + size <= region->address + region->size;
+    } else if (device) {
+        return address + size <= device->address + device->size;
+    }
+    return false;
+}
+
+// Devices are not thread-safe, so harts sharing the memory take turns.
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+memword_t mem_peek_slow(const mem_t *mem, memaddr_t address, memaddr_t size) {
     void *memdata = mem_search(mem, address, size);
+    if (!memdata) {
+        const memdevice_t *device = mem_search_device(mem, address, size);
+        if (mem->shared) {
+            pthread_mutex_lock(&device_lock);
+        }
+        memword_t data = device->read(device->context, address - device->address, size);
+        if (mem->shared) {
+            pthread_mutex_unlock(&device_lock);
+        }
+        return data;
+    }
     switch (size) {
         case 1:
             return *(uint8_t *)memdata;
@@ -157,12 +419,66 @@ memword_t mem_read(const mem_t *mem, memaddr_t address, memaddr_t size) {
         case 4:
             return *(uint32_t *)memdata;
         default:
-            assert(0); // unreachable
+            CHECK(0); // unreachable
+    }
+}
+
+memword_t mem_read_slow(const mem_t *mem, memaddr_t address, memaddr_t size) {
+    memword_t data = mem_peek_slow(mem, address, size);
+    mem_watch_check(mem, WATCH_READ, address, size, data);
+    return data;
+}
+
+// LR, SC, AMOs outside the fast path, and stores to pages with a
+// reservation on them are serialized by this lock when harts share memory.
+static pthread_mutex_t reservation_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool mem_page_reserved(const mem_t *mem, memaddr_t page) {
+    for (unsigned int i = 0; i < MAX_HARTS; i++) {
+        if (mem->reservations[i].valid && ((mem->reservations[i].address >> PAGE_SHIFT) == page)) {
+            return true;
+        }
     }
+    return false;
+}
+
+// Routes the stores to the page of `address` through the slow path, or back
+// to the page table once no reservation is left on it.
+static void mem_update_write_page(mem_t *mem, memaddr_t address) {
+    memaddr_t page = address >> PAGE_SHIFT;
+    uint8_t *mapped = (mem->journal || mem_page_reserved(mem, page)) ? NULL : mem->pages[page];
+    mem_split_write_pages(mem);
+    __atomic_store_n(&mem->write_pages[page], mapped, __ATOMIC_RELAXED);
 }
 
-void mem_write(mem_t *mem, memaddr_t address, memaddr_t size, memword_t data) {
+// A store to any byte of a reserved word invalidates the reservation,
+// whichever hart holds it.
+static void mem_invalidate_reservations(mem_t *mem, memaddr_t address, memaddr_t size) {
+    for (unsigned int i = 0; i < MAX_HARTS; i++) {
+        memreservation_t *reservation = mem->reservations + i;
+        if (reservation->valid && (address - reservation->address < 4 || reservation->address - address < size)) {
+            reservation->valid = false;
+            mem_update_write_page(mem, reservation->address);
+        }
+    }
+}
+
+// Stores to RAM or a device with the reservation lock held, if harts share
+// memory, and neither journaled nor watched.
+static void mem_store_locked(mem_t *mem, memaddr_t address, memaddr_t size, memword_t data) {
     void *memdata = mem_search(mem, address, size);
+    mem_invalidate_reservations(mem, address, size);
+    if (!memdata) {
+        const memdevice_t *device = mem_search_device(mem, address, size);
+        if (mem->shared) {
+            pthread_mutex_lock(&device_lock);
+        }
+        device->write(device->context, address - device->address, size, data);
+        if (mem->shared) {
+            pthread_mutex_unlock(&device_lock);
+        }
+        return;
+    }
     switch (size) {
         case 1:
             *(uint8_t *)memdata = data;
@@ -174,7 +490,44 @@ void mem_write(mem_t *mem, memaddr_t address, memaddr_t size, memword_t data) {
             *(uint32_t *)memdata = data;
             break;
         default:
-            assert(0); // unreachable
+            CHECK(0); // unreachable
+    }
+}
+
+// mem_write_slow() with the reservation lock held, if harts share memory
+static void mem_write_locked(mem_t *mem, memaddr_t address, memaddr_t size, memword_t data) {
+    memword_t masked = (size < sizeof(memword_t)) ? data & (((memword_t)1 << (8 * size)) - 1) : data;
+    if (mem->journal) {
+        CHECK(mem->journal->count < MAX_JOURNAL);
+        mem->journal->writes[mem->journal->count++] = (memwrite_t){
+            .address = address,
+            .size = size,
+            .data = masked,
+        };
+    }
+    mem_watch_check(mem, WATCH_WRITE, address, size, masked);
+    mem_store_locked(mem, address, size, data);
+}
+
+void mem_write_slow(mem_t *mem, memaddr_t address, memaddr_t size, memword_t data) {
+    if (mem->shared) {
+        pthread_mutex_lock(&reservation_lock);
+    }
+    mem_write_locked(mem, address, size, data);
+    if (mem->shared) {
+        pthread_mutex_unlock(&reservation_lock);
+    }
+}
+
+// Like mem_write(), for stores made from outside the guest, such as a test
+// harness poking its inputs: they are neither journaled nor watched.
+void mem_poke(mem_t *mem, memaddr_t address, memaddr_t size, memword_t data) {
+    if (mem->shared) {
+        pthread_mutex_lock(&reservation_lock);
+    }
+    mem_store_locked(mem, address, size, data);
+    if (mem->shared) {
+        pthread_mutex_unlock(&reservation_lock);
     }
 }
 
@@ -183,41 +536,259 @@ void mem_destroy(mem_t *mem) {
     for (unsigned int i = 0; i < mem->num_regions; i++) {
         free(mem->regions[i].data);
     }
+    mem_journal(mem, NULL);
+    free(mem->watched);
+    free(mem->symtab);
+    free(mem->strings);
+    free(mem->pages);
     free(mem);
 }
 
 void mem_dump_signature(mem_t *mem, FILE *fh, unsigned int granularity) {
     assert(mem && fh);
+    CHECK((granularity == 1) || (granularity == 2) || (granularity == 4));
     for (memaddr_t address = mem->symbols[SYM_BEGIN_SIGNATURE];
          address < mem->symbols[SYM_END_SIGNATURE];
          address += granularity)
     {
-        fprintf(fh, "%0*x\n", granularity * 2, mem_read(mem, address, granularity));
+        fprintf(fh, "%0*x\n", granularity * 2, mem_peek(mem, address, granularity));
     }
 }
 
-memword_t reg_read(const regfile_t *regs, unsigned int i) {
+void reg_describe(regfile_t *regs) {
     assert(regs && *regs);
-    assert(i >= 0 && i < NUM_REGS);
-    return i ? *regs[i] : 0;
+    for (int i = 0; i < NUM_REGS; i++) {
+        fprintf(stderr, "x%02d = %08x%c", i, (*regs)[i], (i % 4 == 3) ? '\n' : '\t');
+    }
 }
 
-void reg_write(regfile_t *regs, unsigned int i, memword_t value) {
+void reg_destroy(regfile_t *regs) {
     assert(regs && *regs);
-    assert(i >= 0 && i < NUM_REGS);
-    if (i) {
-        *regs[i] = value;
+    free(*regs);
+}
+
+memword_t csr_read(const csrfile_t *csrs, const mem_t *mem, unsigned int csr) {
+    assert(csrs && mem);
+    switch (csr) {
+        case CSR_MSTATUS:
+            return csrs->mstatus | MSTATUS_MPP; // M-mode only
+        case CSR_MISA:
+#if RV32E
+            return (1u << 30) | (1 << ('E' - 'A')) | (1 << ('M' - 'A')) | (1 << ('A' - 'A'))
+                   | (1 << ('C' - 'A'));
+#else
+            return (1u << 30) | (1 << ('I' - 'A')) | (1 << ('M' - 'A')) | (1 << ('A' - 'A'))
+                   | (1 << ('C' - 'A'));
+#endif
+        case CSR_MIE:
+            return csrs->mie;
+        case CSR_MTVEC:
+            return csrs->mtvec;
+        case CSR_MSCRATCH:
+            return csrs->mscratch;
+        case CSR_MEPC:
+            return csrs->mepc;
+        case CSR_MCAUSE:
+            return csrs->mcause;
+        case CSR_MTVAL:
+            return csrs->mtval;
+        case CSR_MIP:
+            return (clint_load(&mem->clint.mtime) >= clint_load(&mem->clint.mtimecmp[csrs->mhartid])) ? MIP_MTIP : 0;
+        case CSR_MHARTID:
+            return csrs->mhartid;
+        case CSR_MINSTRET:
+        case CSR_INSTRET:
+            return csrs->minstret;
+        case CSR_MINSTRETH:
+        case CSR_INSTRETH:
+            return csrs->minstret >> 32;
+        case CSR_TIME:
+            return clint_load(&mem->clint.mtime);
+        case CSR_TIMEH:
+            return clint_load(&mem->clint.mtime) >> 32;
+        default:
+            CHECK(0); // unimplemented CSR
     }
 }
 
-void reg_describe(regfile_t *regs) {
-    assert(regs && *regs);
-    for (int i = 0; i < NUM_REGS; i++) {
-        fprintf(stderr, "x%02d = %08x%c", i, *regs[i], (i % 4 == 3) ? '\n' : '\t');
+void csr_write(csrfile_t *csrs, unsigned int csr, memword_t value) {
+    assert(csrs);
+    switch (csr) {
+        case CSR_MSTATUS:
+            csrs->mstatus = value & (MSTATUS_MIE | MSTATUS_MPIE);
+            break;
+        case CSR_MIE:
+            csrs->mie = value & MIP_MTIP;
+            break;
+        case CSR_MTVEC:
+            csrs->mtvec = value & ~2u; // modes 0 (direct) and 1 (vectored)
+            break;
+        case CSR_MSCRATCH:
+            csrs->mscratch = value;
+            break;
+        case CSR_MEPC:
+            csrs->mepc = value & ~1u;
+            break;
+        case CSR_MCAUSE:
+            csrs->mcause = value;
+            break;
+        case CSR_MTVAL:
+            csrs->mtval = value;
+            break;
+        case CSR_MINSTRET:
+            csrs->minstret = (csrs->minstret & ~(uint64_t)UINT32_MAX) | value;
+            break;
+        case CSR_MINSTRETH:
+            csrs->minstret = (csrs->minstret & UINT32_MAX) | ((uint64_t)value << 32);
+            break;
+        case CSR_MISA:
+        case CSR_MIP:
+            break; // WARL, no writable fields
+        default:
+            CHECK(0); // unimplemented or read-only CSR
     }
 }
 
-void reg_destroy(regfile_t *regs) {
-    assert(regs && *regs);
-    free(*regs);
+// Returns the interrupts that are both pending and enabled in mie.
+memword_t csr_pending(const csrfile_t *csrs, const mem_t *mem) {
+    return csr_read(csrs, mem, CSR_MIP) & csrs->mie;
+}
+
+// Section 3.1.7 "Machine Trap-Vector Base-Address Register (mtvec)"
+// Enters the trap handler and returns its address.
+memword_t csr_trap(csrfile_t *csrs, memword_t cause, memword_t pc) {
+    assert(csrs);
+    csrs->mepc = pc;
+    csrs->mcause = cause;
+    csrs->mtval = 0;
+    csrs->mstatus = (csrs->mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0;
+    csrs->wfi = false;
+    if ((csrs->mtvec & 1) && (cause & MCAUSE_INTERRUPT)) {
+        return (csrs->mtvec & ~3u) + 4 * (cause & ~MCAUSE_INTERRUPT);
+    }
+    return csrs->mtvec & ~3u;
+}
+
+// Section 3.3.2 "Trap-Return Instructions"
+memword_t csr_mret(csrfile_t *csrs) {
+    assert(csrs);
+    csrs->mstatus = MSTATUS_MPIE | ((csrs->mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0);
+    return csrs->mepc;
+}
+
+static bool amo_apply(unsigned int funct5, uint32_t old, uint32_t operand, uint32_t *value) {
+    switch (funct5) {
+        case F5_AMOSWAP:
+        case F5_SC:
+            *value = operand;
+            return true;
+        case F5_AMOADD:
+            *value = old + operand;
+            return true;
+        case F5_AMOXOR:
+            *value = old ^ operand;
+            return true;
+        case F5_AMOAND:
+            *value = old & operand;
+            return true;
+        case F5_AMOOR:
+            *value = old | operand;
+            return true;
+        case F5_AMOMIN:
+            *value = ((int32_t)old < (int32_t)operand) ? old : operand;
+            return true;
+        case F5_AMOMAX:
+            *value = ((int32_t)old > (int32_t)operand) ? old : operand;
+            return true;
+        case F5_AMOMINU:
+            *value = (old < operand) ? old : operand;
+            return true;
+        case F5_AMOMAXU:
+            *value = (old > operand) ? old : operand;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Chapter 8 "A Standard Extension for Atomic Instructions": performs the
+// word-sized LR, SC or AMO `funct5` at `address` and sets *result to the
+// value for rd. RAM is updated with sequentially consistent host atomics,
+// which is at least as strong as any aq/rl combination, so harts on other
+// threads see each operation whole and in order. Returns false if `funct5`
+// is reserved.
+//
+// Section 8.2 "Load-Reserved/Store-Conditional Instructions": SC fails if
+// any store, from any hart, has written the reserved word since LR. LR
+// takes its page out of write_pages so that stores to it take the slow
+// path, which invalidates the reservation; a store that translated its
+// address just before LR did would still slip past, so SC also checks that
+// the word holds the value LR read.
+bool mem_amo(mem_t *mem, csrfile_t *csrs, memaddr_t address, unsigned int funct5, memword_t operand,
+             memword_t *result) {
+    memreservation_t *reservation = mem->reservations + csrs->mhartid;
+    uint32_t *word = mem_translate(mem->write_pages, address, 4);
+    uint32_t old, value;
+    bool stored = false;
+
+    if ((funct5 != F5_LR) && !amo_apply(funct5, 0, 0, &value)) {
+        return false;
+    }
+    CHECK(!(address & 3)); // misaligned atomics are not supported
+    CHECK(csrs->mhartid < MAX_HARTS);
+    if (word && (funct5 != F5_LR) && (funct5 != F5_SC)) {
+        // A page without reservations, journal or watchpoints
+        old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        do {
+            amo_apply(funct5, old, operand, &value);
+        } while (!__atomic_compare_exchange_n(word, &old, value, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+        *result = (memword_t)(smemword_t)(int32_t)old;
+        return true;
+    }
+
+    if (mem->shared) {
+        pthread_mutex_lock(&reservation_lock);
+    }
+    // RAM whose stores need not be journaled, even if it is reserved
+    word = mem->journal ? NULL : mem_translate(mem->pages, address, 4);
+    if (funct5 == F5_LR) {
+        *reservation = (memreservation_t){ .valid = true, .address = address };
+        mem_update_write_page(mem, address);
+        old = reservation->value = word ? __atomic_load_n(word, __ATOMIC_SEQ_CST) : mem_read(mem, address, 4);
+    } else if (funct5 == F5_SC) {
+        // SC gives up the hart's reservation whether or not it succeeds, so
+        // an SC to another address cannot leave it for a later one
+        bool reserved = reservation->valid && (reservation->address == address);
+        reservation->valid = false;
+        if (reserved) {
+            old = reservation->value;
+            if (word) {
+                stored = __atomic_compare_exchange_n(word, &old, operand, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                if (stored) {
+                    mem_invalidate_reservations(mem, address, 4);
+                }
+            } else if (mem_read(mem, address, 4) == old) {
+                mem_write_locked(mem, address, 4, operand);
+                stored = true;
+            }
+        }
+        mem_update_write_page(mem, reservation->address);
+        old = !stored;
+    } else if (word) {
+        old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        do {
+            amo_apply(funct5, old, operand, &value);
+        } while (!__atomic_compare_exchange_n(word, &old, value, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+        mem_invalidate_reservations(mem, address, 4);
+    } else {
+        // Devices, and RAM whose stores are journaled or watched
+        old = mem_read(mem, address, 4);
+        amo_apply(funct5, old, operand, &value);
+        mem_write_locked(mem, address, 4, value);
+    }
+    if (mem->shared) {
+        pthread_mutex_unlock(&reservation_lock);
+    }
+    *result = (memword_t)(smemword_t)(int32_t)old;
+    return true;
 }
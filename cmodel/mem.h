@@ -1,6 +1,8 @@
 #ifndef _mem_h_
 #define _mem_h_
 
+#include <stdbool.h>
+
 #if RV64I
 typedef uint64_t memaddr_t, memword_t;
 typedef int64_t smemword_t;
@@ -11,12 +13,32 @@ typedef int32_t smemword_t;
 
 #define XLEN (8 * sizeof(memword_t))
 
+// Unlike assert(), CHECK() is kept in NDEBUG builds: it guards reads with
+// side effects and rejects bad input (ELF files, guest accesses) rather than
+// catching bugs in the model itself.
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: %s: Assertion `%s' failed.\n", \
+                __FILE__, __LINE__, __func__, #condition); \
+        abort(); \
+    } \
+} while(0)
+
 typedef struct {
     memaddr_t address;
     memaddr_t size;
     void *data;
+    bool executable;
 } memregion_t;
 
+// A named code or data symbol from the ELF symbol table
+typedef struct {
+    const char *name;
+    memaddr_t address;
+    memaddr_t size; // 0 if unknown
+    bool function;
+} memsymbol_t;
+
 enum {
     SYM_BEGIN_SIGNATURE,
     SYM_END_SIGNATURE,
@@ -25,20 +47,210 @@ enum {
     NUM_SYMS,
 };
 
+// Section 3.2.1 "Machine Timer Registers (mtime and mtimecmp)", at the
+// offsets used by the SiFive CLINT.
+#define CLINT_BASE      0x02000000
+#define CLINT_SIZE      0x00010000
+#define CLINT_MTIMECMP  0x4000
+#define CLINT_MTIME     0xbff8
+
+// Harts sharing one memory, each with its own mtimecmp
+#define MAX_HARTS 8
+
+typedef struct {
+    uint64_t mtime;
+    uint64_t mtimecmp[MAX_HARTS];
+} clint_t;
+
+// Hart 0's thread advances mtime, and any hart's can write mtime or
+// mtimecmp through the CLINT, so every access to them is atomic. Relaxed
+// ordering is enough: the timer only has to be seen to move forward.
+static inline uint64_t clint_load(const uint64_t *reg) {
+    return __atomic_load_n(reg, __ATOMIC_RELAXED);
+}
+
+static inline void clint_advance(clint_t *clint, uint64_t cycles) {
+    __atomic_fetch_add(&clint->mtime, cycles, __ATOMIC_RELAXED);
+}
+
+// Memory-mapped devices are called with the offset into their address range.
+typedef memword_t memdevice_read_t(void *context, memaddr_t offset, memaddr_t size);
+typedef void memdevice_write_t(void *context, memaddr_t offset, memaddr_t size, memword_t data);
+
+typedef struct {
+    const char *name;
+    memaddr_t address;
+    memaddr_t size;
+    memdevice_read_t *read;
+    memdevice_write_t *write;
+    void *context;
+} memdevice_t;
+
+#define MAX_DEVICES 8
+
+// Watchpoints are called for every access that overlaps their range, after
+// reads and before writes. Reads include instruction fetches.
+#define WATCH_READ  1
+#define WATCH_WRITE 2
+
+typedef void memwatch_hit_t(void *context, unsigned int access, memaddr_t address, memaddr_t size,
+                            memword_t data);
+
+typedef struct {
+    memaddr_t address;
+    memaddr_t size;
+    unsigned int access;
+    memwatch_hit_t *hit;
+    void *context;
+} memwatch_t;
+
+#define MAX_WATCHES 8
+
+// Section 8.2 "Load-Reserved/Store-Conditional Instructions": the word a
+// hart has reserved with LR, and the value LR read
+typedef struct {
+    bool valid;
+    memaddr_t address;
+    uint32_t value;
+} memreservation_t;
+
+// Stores collected while a journal is attached, for record/replay. One
+// instruction can take several cycles, so this holds a few entries.
+#define MAX_JOURNAL 4
+
+typedef struct {
+    memaddr_t address;
+    memaddr_t size;
+    memword_t data;
+} memwrite_t;
+
+typedef struct {
+    unsigned int count;
+    memwrite_t writes[MAX_JOURNAL];
+} memjournal_t;
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE ((memaddr_t)1 << PAGE_SHIFT)
+#define NUM_PAGES ((memaddr_t)1 << (32 - PAGE_SHIFT))
+
 typedef struct {
     memaddr_t entry_point;
+    clint_t clint;
+    unsigned int num_devices;
+    memdevice_t devices[MAX_DEVICES];
+    uint8_t **pages; // host address of each validated RAM page, or NULL
+    uint8_t **write_pages; // same as pages, unless stores need the slow path
+    bool shared; // by harts on several host threads
+    // By mhartid. Pages with a reservation are left out of write_pages, so
+    // that stores to them take the slow path, which invalidates it.
+    memreservation_t reservations[MAX_HARTS];
+    memjournal_t *journal;
+    unsigned int num_watches;
+    memwatch_t watches[MAX_WATCHES];
+    uint64_t *watched; // bitmap of pages with watchpoints, or NULL
     unsigned int num_regions;
     memaddr_t symbols[NUM_SYMS];
+    unsigned int num_symtab;
+    memsymbol_t *symtab; // sorted by address
+    char *strings;
     memregion_t regions[];
 } mem_t;
 
 mem_t *mem_loadelf(FILE *fh);
+bool mem_contains(const mem_t *mem, memaddr_t address);
+bool mem_mapped(const mem_t *mem, memaddr_t address, memaddr_t size);
+bool mem_lookup_symbol(const mem_t *mem, const char *name, memaddr_t *address);
+const memsymbol_t *mem_symbol_at(const mem_t *mem, memaddr_t address);
+void mem_map_device(mem_t *mem, const memdevice_t *device);
+void mem_journal(mem_t *mem, memjournal_t *journal);
+void mem_share(mem_t *mem, bool shared);
+void mem_watch(mem_t *mem, const memwatch_t *watch);
 void mem_describe(mem_t *mem, FILE *fh);
-memword_t mem_read(const mem_t *mem, memaddr_t address, memaddr_t size);
-void mem_write(mem_t *mem, memaddr_t address, memaddr_t size, memword_t data);
+memword_t mem_read_slow(const mem_t *mem, memaddr_t address, memaddr_t size);
+memword_t mem_peek_slow(const mem_t *mem, memaddr_t address, memaddr_t size);
+void mem_write_slow(mem_t *mem, memaddr_t address, memaddr_t size, memword_t data);
+void mem_poke(mem_t *mem, memaddr_t address, memaddr_t size, memword_t data);
 void mem_dump_signature(mem_t *mem, FILE *fh, unsigned int granularity);
 void mem_destroy(mem_t *mem);
 
+// The access size is a constant 1, 2 or 4 at every call site, so the only
+// per-access test left on the fast path is page presence and alignment.
+// Anything else, including every illegal access, is diagnosed by the slow
+// path.
+static inline void *mem_translate(uint8_t *const *pages, memaddr_t address, memaddr_t size) {
+#if RV64I
+    if (address >> 32) {
+        return NULL;
+    }
+#endif
+    // Relaxed, because LR on another hart may unmap a page from write_pages
+    uint8_t *page = __atomic_load_n(&pages[address >> PAGE_SHIFT], __ATOMIC_RELAXED);
+    return (page && !(address & (size - 1))) ? page + (address & (PAGE_SIZE - 1)) : NULL;
+}
+
+static inline memword_t mem_read(const mem_t *mem, memaddr_t address, memaddr_t size) {
+    void *memdata = mem_translate(mem->pages, address, size);
+    if (!memdata) {
+        return mem_read_slow(mem, address, size);
+    }
+    switch (size) {
+        case 1:
+            return *(uint8_t *)memdata;
+        case 2:
+            return *(uint16_t *)memdata;
+        default:
+            return *(uint32_t *)memdata;
+    }
+}
+
+// Like mem_read(), for the simulator's own accesses, which must not trigger
+// watchpoints.
+static inline memword_t mem_peek(const mem_t *mem, memaddr_t address, memaddr_t size) {
+    void *memdata = mem_translate(mem->pages, address, size);
+    if (!memdata) {
+        return mem_peek_slow(mem, address, size);
+    }
+    switch (size) {
+        case 1:
+            return *(uint8_t *)memdata;
+        case 2:
+            return *(uint16_t *)memdata;
+        default:
+            return *(uint32_t *)memdata;
+    }
+}
+
+static inline void mem_write(mem_t *mem, memaddr_t address, memaddr_t size, memword_t data) {
+    void *memdata = mem_translate(mem->write_pages, address, size);
+    if (!memdata) {
+        mem_write_slow(mem, address, size, data);
+        return;
+    }
+    switch (size) {
+        case 1:
+            *(uint8_t *)memdata = data;
+            break;
+        case 2:
+            *(uint16_t *)memdata = data;
+            break;
+        default:
+            *(uint32_t *)memdata = data;
+            break;
+    }
+}
+
+// Section 1.5 "Base Instruction-Length Encoding": fetches as many 16-bit
+// parcels as the instruction at pc needs, counting one bus cycle for each.
+static inline uint32_t mem_fetch(const mem_t *mem, memaddr_t pc, uint64_t *parcels) {
+    uint32_t parcel = mem_read(mem, pc, 2);
+    (*parcels)++;
+    if ((parcel & 3) == 3) {
+        parcel |= (uint32_t)mem_read(mem, pc + 2, 2) << 16;
+        (*parcels)++;
+    }
+    return parcel;
+}
+
 #if RV32E
 #define NUM_REGS 16
 #else
@@ -47,9 +259,40 @@ void mem_destroy(mem_t *mem);
 
 typedef memword_t regfile_t[NUM_REGS];
 
-memword_t reg_read(const regfile_t *regs, unsigned int i);
-void reg_write(regfile_t *regs, unsigned int i, memword_t value);
+// Register indices are validated when an instruction is decoded, and x0 is
+// kept at zero by reg_write(), so neither accessor needs to branch.
+static inline memword_t reg_read(regfile_t *regs, unsigned int i) {
+    return (*regs)[i];
+}
+
+static inline void reg_write(regfile_t *regs, unsigned int i, memword_t value) {
+    (*regs)[i] = value;
+    (*regs)[0] = 0;
+}
+
 void reg_describe(regfile_t *regs);
 void reg_destroy(regfile_t *regs);
 
+typedef struct {
+    memword_t mstatus;
+    memword_t mie;
+    memword_t mtvec;
+    memword_t mscratch;
+    memword_t mepc;
+    memword_t mcause;
+    memword_t mtval;
+    uint64_t minstret;
+    memword_t mhartid;
+    bool wfi; // stalled on WFI until an interrupt is pending
+    uint64_t fetch_parcels; // 16-bit instruction fetches, one bus cycle each
+} csrfile_t;
+
+memword_t csr_read(const csrfile_t *csrs, const mem_t *mem, unsigned int csr);
+void csr_write(csrfile_t *csrs, unsigned int csr, memword_t value);
+memword_t csr_pending(const csrfile_t *csrs, const mem_t *mem);
+memword_t csr_trap(csrfile_t *csrs, memword_t cause, memword_t pc);
+memword_t csr_mret(csrfile_t *csrs);
+bool mem_amo(mem_t *mem, csrfile_t *csrs, memaddr_t address, unsigned int funct5, memword_t operand,
+             memword_t *result);
+
 #endif // _mem_h_
@@ -0,0 +1,372 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+#include "replay.h"
+
+// Log layout: a header, then one variable-length record per retired
+// instruction, then the memory checkpoints, the index and a fixed-size
+// footer. Each record is a
+// flags byte followed by only the fields that are not predictable:
+//
+//   flags[0]    next_pc is not pc + length; a zigzag varint delta follows
+//   flags[1]    a register changed; rd and a zigzag varint delta follow
+//   flags[4:2]  number of stores; each is log2(size), a zigzag varint
+//               address delta and a varint value
+//   flags[5]    the instruction is compressed: its length is 2, not 4
+//
+// Straight-line code without stores therefore costs 1-3 bytes/instruction.
+//
+// A checkpoint is a sequence of runs, each an address, a 32-bit length and
+// that many bytes, in increasing address order.
+
+static const char replay_magic[8] = "YRVLOG03";
+
+typedef struct {
+    char magic[8];
+    uint32_t entry_point;
+    uint32_t num_regs;
+} replay_header_t;
+
+typedef struct {
+    uint64_t total;
+    uint64_t num_index;
+    uint64_t checkpoint_offset;
+    uint64_t index_offset;
+    char magic[8];
+} replay_footer_t;
+
+typedef struct {
+    memaddr_t address;
+    uint64_t order;
+    uint8_t value;
+} replay_byte_t;
+
+static inline uint32_t zigzag(memword_t delta) {
+    return ((uint32_t)delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+static inline memword_t unzigzag(uint32_t value) {
+    return (value >> 1) ^ -(value & 1);
+}
+
+static void put_varint(replay_t *replay, uint32_t value) {
+    do {
+        putc((value & 0x7f) | ((value > 0x7f) ? 0x80 : 0), replay->fh);
+        replay->offset++;
+        value >>= 7;
+    } while (value);
+}
+
+static uint32_t get_varint(replay_t *replay) {
+    uint32_t value = 0;
+    for (unsigned int shift = 0; ; shift += 7) {
+        CHECK((replay->offset < replay->size) && (shift < 32));
+        uint8_t byte = replay->data[replay->offset++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+static int replay_byte_compare(const void *a, const void *b) {
+    const replay_byte_t *x = a, *y = b;
+    if (x->address != y->address) {
+        return (x->address < y->address) ? -1 : 1;
+    }
+    return (x->order < y->order) ? -1 : (x->order > y->order);
+}
+
+// Coalesces the stores since the last snapshot into runs of the last value
+// written to each byte, and appends them to the checkpoints.
+static void replay_checkpoint(replay_t *replay, replay_index_t *snapshot) {
+    uint64_t num_bytes = 0, num_unique = 0;
+    for (uint64_t i = 0; i < replay->num_pending; i++) {
+        num_bytes += replay->pending[i].size;
+    }
+    replay_byte_t *bytes = malloc(num_bytes * sizeof(replay_byte_t));
+    CHECK(bytes || !num_bytes);
+    for (uint64_t i = 0, n = 0; i < replay->num_pending; i++) {
+        const memwrite_t *write = replay->pending + i;
+        for (memaddr_t j = 0; j < write->size; j++, n++) {
+            bytes[n] = (replay_byte_t){ write->address + j, n, (uint8_t)(write->data >> (8 * j)) };
+        }
+    }
+    qsort(bytes, num_bytes, sizeof(replay_byte_t), replay_byte_compare);
+    for (uint64_t i = 0; i < num_bytes; i++) {
+        if ((i + 1 == num_bytes) || (bytes[i + 1].address != bytes[i].address)) {
+            bytes[num_unique++] = bytes[i];
+        }
+    }
+
+    // At worst every byte starts a run
+    replay->checkpoints = realloc(replay->checkpoints, replay->checkpoints_size
+                                  + num_unique * (sizeof(memaddr_t) + sizeof(uint32_t) + 1) + 1);
+    CHECK(replay->checkpoints);
+    snapshot->checkpoint_offset = replay->checkpoints_size;
+    for (uint64_t i = 0, end; i < num_unique; i = end) {
+        for (end = i + 1; (end < num_unique) && (bytes[end].address == bytes[end - 1].address + 1); end++) {
+        }
+        memaddr_t address = bytes[i].address;
+        uint32_t length = end - i;
+        uint8_t *run = replay->checkpoints + replay->checkpoints_size;
+        memcpy(run, &address, sizeof(address));
+        memcpy(run + sizeof(address), &length, sizeof(length));
+        for (uint64_t j = i; j < end; j++) {
+            run[sizeof(address) + sizeof(length) + j - i] = bytes[j].value;
+        }
+        replay->checkpoints_size += sizeof(address) + sizeof(length) + length;
+    }
+    snapshot->checkpoint_size = replay->checkpoints_size - snapshot->checkpoint_offset;
+    replay->num_pending = 0;
+    free(bytes);
+}
+
+// Applies a checkpoint to RAM. Device side effects are not replayed.
+static void replay_restore(const replay_t *replay, const replay_index_t *snapshot, mem_t *mem) {
+    const uint8_t *run = replay->checkpoints + snapshot->checkpoint_offset;
+    const uint8_t *end = run + snapshot->checkpoint_size;
+    while (run < end) {
+        memaddr_t address;
+        uint32_t length;
+        CHECK((size_t)(end - run) >= sizeof(address) + sizeof(length));
+        memcpy(&address, run, sizeof(address));
+        memcpy(&length, run + sizeof(address), sizeof(length));
+        run += sizeof(address) + sizeof(length);
+        CHECK(length <= (size_t)(end - run));
+        for (uint32_t i = 0; i < length; i++) {
+            if (mem_contains(mem, address + i)) {
+                mem_write(mem, address + i, 1, run[i]);
+            }
+        }
+        run += length;
+    }
+}
+
+static void replay_snapshot(replay_t *replay) {
+    if (replay->count % REPLAY_INDEX_INTERVAL) {
+        return;
+    }
+    replay->index = realloc(replay->index, (replay->num_index + 1) * sizeof(replay_index_t));
+    CHECK(replay->index);
+    replay_index_t *snapshot = replay->index + replay->num_index++;
+    replay_checkpoint(replay, snapshot);
+    snapshot->count = replay->count;
+    snapshot->offset = replay->offset;
+    snapshot->pc = replay->pc;
+    snapshot->last_address = replay->last_address;
+    memcpy(snapshot->regs, replay->regs, sizeof(replay->regs));
+}
+
+replay_t *replay_create(FILE *fh, memword_t pc) {
+    replay_t *replay = calloc(1, sizeof(replay_t));
+    replay_header_t header = { .entry_point = pc, .num_regs = NUM_REGS };
+    CHECK(replay);
+    memcpy(header.magic, replay_magic, sizeof(header.magic));
+    CHECK(fwrite(&header, sizeof(header), 1, fh));
+    replay->pending = malloc(REPLAY_INDEX_INTERVAL * MAX_JOURNAL * sizeof(memwrite_t));
+    CHECK(replay->pending);
+    replay->fh = fh;
+    replay->offset = sizeof(header);
+    replay->pc = replay->entry_point = pc;
+    return replay;
+}
+
+void replay_append(replay_t *replay, const replay_entry_t *entry) {
+    assert(replay && replay->fh && entry);
+    bool jump = entry->next_pc != replay->pc + entry->length;
+    uint8_t flags = (jump ? 1 : 0) | (entry->rd ? 2 : 0) | (entry->journal.count << 2)
+                    | ((entry->length == 2) ? 0x20 : 0);
+
+    replay_snapshot(replay);
+    putc(flags, replay->fh);
+    replay->offset++;
+    if (jump) {
+        put_varint(replay, zigzag(entry->next_pc - (replay->pc + entry->length)));
+    }
+    if (entry->rd) {
+        putc(entry->rd, replay->fh);
+        replay->offset++;
+        put_varint(replay, zigzag(entry->rd_value - replay->regs[entry->rd]));
+        replay->regs[entry->rd] = entry->rd_value;
+    }
+    for (unsigned int i = 0; i < entry->journal.count; i++) {
+        const memwrite_t *write = entry->journal.writes + i;
+        putc((write->size == 1) ? 0 : (write->size == 2) ? 1 : 2, replay->fh);
+        replay->offset++;
+        put_varint(replay, zigzag(write->address - replay->last_address));
+        put_varint(replay, write->data);
+        replay->last_address = write->address;
+        replay->pending[replay->num_pending++] = *write;
+    }
+    replay->pc = entry->next_pc;
+    replay->count++;
+}
+
+replay_t *replay_open(FILE *fh) {
+    replay_t *replay = calloc(1, sizeof(replay_t));
+    replay_header_t header;
+    replay_footer_t footer;
+    CHECK(replay);
+    CHECK(!fseek(fh, 0, SEEK_END));
+    replay->size = ftell(fh);
+    CHECK(replay->size >= sizeof(header) + sizeof(footer));
+    replay->data = malloc(replay->size);
+    CHECK(replay->data);
+    CHECK(!fseek(fh, 0, SEEK_SET));
+    CHECK(fread(replay->data, replay->size, 1, fh));
+
+    memcpy(&header, replay->data, sizeof(header));
+    memcpy(&footer, replay->data + replay->size - sizeof(footer), sizeof(footer));
+    CHECK(!memcmp(header.magic, replay_magic, sizeof(header.magic)));
+    CHECK(!memcmp(footer.magic, replay_magic, sizeof(footer.magic)));
+    CHECK(header.num_regs == NUM_REGS);
+    CHECK(footer.index_offset + footer.num_index * sizeof(replay_index_t) + sizeof(footer) == replay->size);
+    CHECK((footer.checkpoint_offset >= sizeof(header)) && (footer.checkpoint_offset <= footer.index_offset));
+    replay->total = footer.total;
+    replay->num_index = footer.num_index;
+    replay->index = malloc(footer.num_index * sizeof(replay_index_t));
+    CHECK(replay->index || !footer.num_index);
+    memcpy(replay->index, replay->data + footer.index_offset, footer.num_index * sizeof(replay_index_t));
+    replay->checkpoints = replay->data + footer.checkpoint_offset;
+    replay->checkpoints_size = footer.index_offset - footer.checkpoint_offset;
+    for (unsigned int i = 0; i < replay->num_index; i++) {
+        const replay_index_t *snapshot = replay->index + i;
+        CHECK((snapshot->checkpoint_offset <= replay->checkpoints_size)
+              && (snapshot->checkpoint_size <= replay->checkpoints_size - snapshot->checkpoint_offset));
+    }
+    replay->size = footer.checkpoint_offset; // records end where the checkpoints begin
+    replay->offset = sizeof(header);
+    replay->pc = replay->entry_point = header.entry_point;
+    return replay;
+}
+
+// Decodes the next entry. Returns false at the end of the log.
+bool replay_next(replay_t *replay, replay_entry_t *entry) {
+    assert(replay && replay->data && entry);
+    if (replay->count == replay->total) {
+        return false;
+    }
+    CHECK(replay->offset < replay->size);
+    uint8_t flags = replay->data[replay->offset++];
+
+    entry->length = (flags & 0x20) ? 2 : 4;
+    entry->next_pc = replay->pc + entry->length;
+    if (flags & 1) {
+        entry->next_pc += unzigzag(get_varint(replay));
+    }
+    entry->rd = 0;
+    if (flags & 2) {
+        CHECK(replay->offset < replay->size);
+        entry->rd = replay->data[replay->offset++];
+        CHECK(entry->rd && (entry->rd < NUM_REGS));
+        entry->rd_value = replay->regs[entry->rd] + unzigzag(get_varint(replay));
+        replay->regs[entry->rd] = entry->rd_value;
+    }
+    entry->journal.count = (flags >> 2) & 7;
+    CHECK(entry->journal.count <= MAX_JOURNAL);
+    for (unsigned int i = 0; i < entry->journal.count; i++) {
+        memwrite_t *write = entry->journal.writes + i;
+        CHECK(replay->offset < replay->size);
+        write->size = 1 << replay->data[replay->offset++];
+        write->address = replay->last_address + unzigzag(get_varint(replay));
+        write->data = get_varint(replay);
+        replay->last_address = write->address;
+    }
+    replay->pc = entry->next_pc;
+    replay->count++;
+    return true;
+}
+
+// Reconstructs the state after `count` instructions have retired: the
+// register file and pc in the replay decoder and, if `mem` is given, the
+// contents of RAM. Decoding resumes from the nearest index snapshot, after
+// the checkpoints up to it have brought RAM to the same point. Nothing is
+// re-executed.
+void replay_seek(replay_t *replay, uint64_t count, mem_t *mem) {
+    replay_entry_t entry;
+    assert(replay && replay->data);
+    CHECK(count <= replay->total);
+    replay->offset = sizeof(replay_header_t);
+    replay->count = 0;
+    replay->pc = replay->entry_point;
+    replay->last_address = 0;
+    memset(replay->regs, 0, sizeof(replay->regs));
+    if (replay->num_index) {
+        uint64_t i = count / REPLAY_INDEX_INTERVAL;
+        const replay_index_t *snapshot = replay->index + ((i < replay->num_index) ? i : replay->num_index - 1);
+        for (const replay_index_t *checkpoint = replay->index; mem && (checkpoint <= snapshot); checkpoint++) {
+            replay_restore(replay, checkpoint, mem);
+        }
+        replay->offset = snapshot->offset;
+        replay->count = snapshot->count;
+        replay->pc = snapshot->pc;
+        replay->last_address = snapshot->last_address;
+        memcpy(replay->regs, snapshot->regs, sizeof(replay->regs));
+    }
+    while (replay->count < count) {
+        replay_next(replay, &entry);
+        for (unsigned int i = 0; mem && (i < entry.journal.count); i++) {
+            const memwrite_t *write = entry.journal.writes + i;
+            if (mem_contains(mem, write->address)) { // device side effects are not replayed
+                mem_write(mem, write->address, write->size, write->data);
+            }
+        }
+    }
+}
+
+// Returns true if both entries match, otherwise describes the difference.
+bool replay_compare(const replay_entry_t *expected, const replay_entry_t *actual, FILE *fh) {
+    bool match = true;
+    if (expected->next_pc != actual->next_pc) {
+        fprintf(fh, "next pc: expected %08x, got %08x\n", expected->next_pc, actual->next_pc);
+        match = false;
+    }
+    if ((expected->rd != actual->rd)
+        || (expected->rd && (expected->rd_value != actual->rd_value))) {
+        fprintf(fh, "register write: expected x%02d = %08x, got x%02d = %08x\n",
+                expected->rd, expected->rd ? expected->rd_value : 0,
+                actual->rd, actual->rd ? actual->rd_value : 0);
+        match = false;
+    }
+    if (expected->journal.count != actual->journal.count) {
+        fprintf(fh, "stores: expected %u, got %u\n", expected->journal.count, actual->journal.count);
+        return false;
+    }
+    for (unsigned int i = 0; i < expected->journal.count; i++) {
+        const memwrite_t *e = expected->journal.writes + i;
+        const memwrite_t *a = actual->journal.writes + i;
+        if ((e->address != a->address) || (e->size != a->size) || (e->data != a->data)) {
+            fprintf(fh, "store: expected [%08x].%u = %08x, got [%08x].%u = %08x\n",
+                    e->address, e->size, e->data, a->address, a->size, a->data);
+            match = false;
+        }
+    }
+    return match;
+}
+
+void replay_close(replay_t *replay) {
+    assert(replay);
+    if (replay->fh) {
+        replay_footer_t footer = {
+            .total = replay->count,
+            .num_index = replay->num_index,
+            .checkpoint_offset = replay->offset,
+            .index_offset = replay->offset + replay->checkpoints_size,
+        };
+        memcpy(footer.magic, replay_magic, sizeof(footer.magic));
+        CHECK(fwrite(replay->checkpoints, 1, replay->checkpoints_size, replay->fh) == replay->checkpoints_size);
+        CHECK(fwrite(replay->index, sizeof(replay_index_t), replay->num_index, replay->fh) == replay->num_index);
+        CHECK(fwrite(&footer, sizeof(footer), 1, replay->fh));
+        CHECK(!fclose(replay->fh));
+        free(replay->checkpoints);
+    }
+    free(replay->pending);
+    free(replay->index);
+    free(replay->data);
+    free(replay);
+}
@@ -0,0 +1,58 @@
+#ifndef _replay_h_
+#define _replay_h_
+
+// Architectural side effects of one retired instruction: the register it
+// changed (rd = 0 if none), every store it made, and where execution goes
+// next. Its length predicts the next pc.
+typedef struct {
+    memword_t next_pc;
+    unsigned int length; // of the instruction in bytes, 2 if compressed
+    unsigned int rd;
+    memword_t rd_value;
+    memjournal_t journal;
+} replay_entry_t;
+
+// Every REPLAY_INDEX_INTERVAL entries the log records a snapshot of the
+// decoder state, and a checkpoint of the final value of every byte stored
+// to since the previous snapshot. Seeking applies the checkpoints up to the
+// nearest snapshot, then only has to decode from there.
+#define REPLAY_INDEX_INTERVAL 65536
+
+typedef struct {
+    uint64_t count;
+    uint64_t offset;
+    uint64_t checkpoint_offset; // from the start of the checkpoints
+    uint64_t checkpoint_size;
+    memword_t pc;
+    memaddr_t last_address;
+    memword_t regs[NUM_REGS];
+} replay_index_t;
+
+typedef struct {
+    FILE *fh;               // open for recording, or NULL when replaying
+    uint8_t *data;          // the whole log, when replaying
+    uint64_t size;
+    uint64_t offset;
+    uint64_t count;         // entries encoded or decoded so far
+    uint64_t total;         // entries in the log, when replaying
+    memword_t pc;           // pc of the next instruction to retire
+    memaddr_t last_address; // stores are delta-encoded against this
+    regfile_t regs;         // register values are delta-encoded against this
+    memword_t entry_point;
+    unsigned int num_index;
+    replay_index_t *index;
+    memwrite_t *pending;    // stores since the last snapshot, when recording
+    uint64_t num_pending;
+    uint8_t *checkpoints;   // when recording, written out by replay_close()
+    uint64_t checkpoints_size;
+} replay_t;
+
+replay_t *replay_create(FILE *fh, memword_t pc);
+void replay_append(replay_t *replay, const replay_entry_t *entry);
+replay_t *replay_open(FILE *fh);
+bool replay_next(replay_t *replay, replay_entry_t *entry);
+void replay_seek(replay_t *replay, uint64_t count, mem_t *mem);
+bool replay_compare(const replay_entry_t *expected, const replay_entry_t *actual, FILE *fh);
+void replay_close(replay_t *replay);
+
+#endif // _replay_h_
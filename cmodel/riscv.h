@@ -33,6 +33,28 @@ typedef enum {
     F3_JALR,    /* rsvd */  /* rsvd */  /* rsvd */  /* rsvd */  /* rsvd */  /* rsvd */  /* rsvd */
 } funct3_jalr_t;
 
+// Chapter 7 "M Standard Extension for Integer Multiplication and Division"
+#define F7_MULDIV       0x01
+
+typedef enum {
+    F3_MUL,     F3_MULH,    F3_MULHSU,  F3_MULHU,   F3_DIV,     F3_DIVU,    F3_REM,     F3_REMU,
+} funct3_muldiv_t;
+
+// Chapter 8 "A Standard Extension for Atomic Instructions", in funct7[6:2]
+typedef enum {
+    F5_AMOADD = 0x00,
+    F5_AMOSWAP = 0x01,
+    F5_LR = 0x02,
+    F5_SC = 0x03,
+    F5_AMOXOR = 0x04,
+    F5_AMOOR = 0x08,
+    F5_AMOAND = 0x0c,
+    F5_AMOMIN = 0x10,
+    F5_AMOMAX = 0x14,
+    F5_AMOMINU = 0x18,
+    F5_AMOMAXU = 0x1c,
+} funct5_amo_t;
+
 typedef enum {
     F12_ECALL,
     F12_EBREAK,
@@ -40,6 +62,39 @@ typedef enum {
     F12_WFI = 0x105,
 } funct12_priv_t;
 
+typedef enum {
+    // Table 8 "Currently allocated RISC-V machine-level CSR addresses"
+    CSR_MSTATUS = 0x300,
+    CSR_MISA = 0x301,
+    CSR_MIE = 0x304,
+    CSR_MTVEC = 0x305,
+    CSR_MSCRATCH = 0x340,
+    CSR_MEPC = 0x341,
+    CSR_MCAUSE = 0x342,
+    CSR_MTVAL = 0x343,
+    CSR_MIP = 0x344,
+    CSR_MINSTRET = 0xb02,
+    CSR_MINSTRETH = 0xb82,
+    CSR_MHARTID = 0xf14,
+    // Table 4 "Currently allocated RISC-V unprivileged CSR addresses"
+    CSR_TIME = 0xc01,
+    CSR_INSTRET = 0xc02,
+    CSR_TIMEH = 0xc81,
+    CSR_INSTRETH = 0xc82,
+} csr_addr_t;
+
+// Section 3.1.6 "Machine Status Registers (mstatus and mstatush)"
+#define MSTATUS_MIE     (1 << 3)
+#define MSTATUS_MPIE    (1 << 7)
+#define MSTATUS_MPP     (3 << 11)
+
+// Section 3.1.9 "Machine Interrupt Registers (mip and mie)"
+#define MIP_MTIP        (1 << 7)
+
+// Section 3.1.15 "Machine Cause Register (mcause)"
+#define MCAUSE_INTERRUPT (1u << 31)
+#define IRQ_M_TIMER     7
+
 typedef union {
     struct {
         unsigned int quadrant:2;
@@ -0,0 +1,151 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "riscv.h"
+#include "rvc.h"
+
+// Section 16.8 "RVC Instruction Set Listings": every RV32C instruction is
+// expanded to the 32-bit instruction it stands for, so the models execute
+// it with their existing handlers. Reserved encodings and those of
+// unsupported extensions (F, D, RV64) expand to 0, which is illegal.
+
+#define BITS(value, hi, lo) (((value) >> (lo)) & ((1u << ((hi) - (lo) + 1)) - 1))
+#define RVC_REG(field) (8 + (field)) // x8-x15 for the 3-bit register fields
+
+static uint32_t rvc_r(base_opcode_t opcode, unsigned int funct7, unsigned int funct3, unsigned int rd,
+                      unsigned int rs1, unsigned int rs2) {
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | (opcode << 2) | 3;
+}
+
+static uint32_t rvc_i(base_opcode_t opcode, unsigned int funct3, unsigned int rd, unsigned int rs1, int32_t imm) {
+    return ((uint32_t)imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | (opcode << 2) | 3;
+}
+
+static uint32_t rvc_s(unsigned int funct3, unsigned int rs1, unsigned int rs2, int32_t imm) {
+    return (BITS((uint32_t)imm, 11, 5) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12)
+           | (BITS((uint32_t)imm, 4, 0) << 7) | (OP_STORE << 2) | 3;
+}
+
+static uint32_t rvc_b(unsigned int funct3, unsigned int rs1, int32_t imm) {
+    uint32_t offset = imm;
+    return (BITS(offset, 12, 12) << 31) | (BITS(offset, 10, 5) << 25) | (rs1 << 15) | (funct3 << 12)
+           | (BITS(offset, 4, 1) << 8) | (BITS(offset, 11, 11) << 7) | (OP_BRANCH << 2) | 3;
+}
+
+static uint32_t rvc_j(unsigned int rd, int32_t imm) {
+    uint32_t offset = imm;
+    return (BITS(offset, 20, 20) << 31) | (BITS(offset, 10, 1) << 21) | (BITS(offset, 11, 11) << 20)
+           | (BITS(offset, 19, 12) << 12) | (rd << 7) | (OP_JAL << 2) | 3;
+}
+
+// Sign-extends the low `bits` bits
+static int32_t rvc_sext(uint32_t value, unsigned int bits) {
+    return (int32_t)(value << (32 - bits)) >> (32 - bits);
+}
+
+uint32_t rvc_expand(uint16_t parcel) {
+    unsigned int funct3 = BITS(parcel, 15, 13);
+    unsigned int rd = BITS(parcel, 11, 7); // also rs1
+    unsigned int rs2 = BITS(parcel, 6, 2);
+    unsigned int rdp = RVC_REG(BITS(parcel, 4, 2)); // also rs2'
+    unsigned int rs1p = RVC_REG(BITS(parcel, 9, 7)); // also rd'
+    int32_t imm6 = rvc_sext((BITS(parcel, 12, 12) << 5) | BITS(parcel, 6, 2), 6);
+    uint32_t uimm;
+    int32_t offset;
+
+    switch ((BITS(parcel, 1, 0) << 3) | funct3) {
+        // Quadrant 0
+        case 000: // C.ADDI4SPN
+            uimm = (BITS(parcel, 12, 11) << 4) | (BITS(parcel, 10, 7) << 6)
+                   | (BITS(parcel, 6, 6) << 2) | (BITS(parcel, 5, 5) << 3);
+            return uimm ? rvc_i(OP_OPIMM, F3_ADD_SUB, rdp, 2, uimm) : 0;
+        case 002: // C.LW
+            uimm = (BITS(parcel, 12, 10) << 3) | (BITS(parcel, 6, 6) << 2) | (BITS(parcel, 5, 5) << 6);
+            return rvc_i(OP_LOAD, F3_WORD, rdp, rs1p, uimm);
+        case 006: // C.SW
+            uimm = (BITS(parcel, 12, 10) << 3) | (BITS(parcel, 6, 6) << 2) | (BITS(parcel, 5, 5) << 6);
+            return rvc_s(F3_WORD, rs1p, rdp, uimm);
+
+        // Quadrant 1
+        case 010: // C.ADDI, C.NOP
+            return rvc_i(OP_OPIMM, F3_ADD_SUB, rd, rd, imm6);
+        case 011: // C.JAL
+        case 015: // C.J
+            offset = rvc_sext((BITS(parcel, 12, 12) << 11) | (BITS(parcel, 11, 11) << 4)
+                              | (BITS(parcel, 10, 9) << 8) | (BITS(parcel, 8, 8) << 10)
+                              | (BITS(parcel, 7, 7) << 6) | (BITS(parcel, 6, 6) << 7)
+                              | (BITS(parcel, 5, 3) << 1) | (BITS(parcel, 2, 2) << 5), 12);
+            return rvc_j((funct3 == 1) ? 1 : 0, offset);
+        case 012: // C.LI
+            return rvc_i(OP_OPIMM, F3_ADD_SUB, rd, 0, imm6);
+        case 013:
+            if (rd == 2) { // C.ADDI16SP
+                offset = rvc_sext((BITS(parcel, 12, 12) << 9) | (BITS(parcel, 6, 6) << 4)
+                                  | (BITS(parcel, 5, 5) << 6) | (BITS(parcel, 4, 3) << 7)
+                                  | (BITS(parcel, 2, 2) << 5), 10);
+                return offset ? rvc_i(OP_OPIMM, F3_ADD_SUB, 2, 2, offset) : 0;
+            }
+            // C.LUI
+            return imm6 ? (((uint32_t)imm6 << 12) | (rd << 7) | (OP_LUI << 2) | 3) : 0;
+        case 014:
+            switch (BITS(parcel, 11, 10)) {
+                case 0: // C.SRLI
+                case 1: // C.SRAI
+                    if (BITS(parcel, 12, 12)) {
+                        return 0; // shamt[5] is reserved in RV32C
+                    }
+                    return rvc_r(OP_OPIMM, BITS(parcel, 10, 10) << 5, F3_SRL_SRA, rs1p, rs1p, rs2);
+                case 2: // C.ANDI
+                    return rvc_i(OP_OPIMM, F3_AND, rs1p, rs1p, imm6);
+                default:
+                    if (BITS(parcel, 12, 12)) {
+                        return 0; // C.SUBW, C.ADDW
+                    }
+                    switch (BITS(parcel, 6, 5)) {
+                        case 0: // C.SUB
+                            return rvc_r(OP_OP, 0x20, F3_ADD_SUB, rs1p, rs1p, rdp);
+                        case 1: // C.XOR
+                            return rvc_r(OP_OP, 0, F3_XOR, rs1p, rs1p, rdp);
+                        case 2: // C.OR
+                            return rvc_r(OP_OP, 0, F3_OR, rs1p, rs1p, rdp);
+                        default: // C.AND
+                            return rvc_r(OP_OP, 0, F3_AND, rs1p, rs1p, rdp);
+                    }
+            }
+        case 016: // C.BEQZ
+        case 017: // C.BNEZ
+            offset = rvc_sext((BITS(parcel, 12, 12) << 8) | (BITS(parcel, 11, 10) << 3)
+                              | (BITS(parcel, 6, 5) << 6) | (BITS(parcel, 4, 3) << 1)
+                              | (BITS(parcel, 2, 2) << 5), 9);
+            return rvc_b((funct3 == 6) ? F3_BEQ : F3_BNE, rs1p, offset);
+
+        // Quadrant 2
+        case 020: // C.SLLI
+            if (BITS(parcel, 12, 12)) {
+                return 0; // shamt[5] is reserved in RV32C
+            }
+            return rvc_r(OP_OPIMM, 0, F3_SLL, rd, rd, rs2);
+        case 022: // C.LWSP
+            uimm = (BITS(parcel, 12, 12) << 5) | (BITS(parcel, 6, 4) << 2) | (BITS(parcel, 3, 2) << 6);
+            return rd ? rvc_i(OP_LOAD, F3_WORD, rd, 2, uimm) : 0;
+        case 024:
+            if (!BITS(parcel, 12, 12)) {
+                if (!rs2) { // C.JR
+                    return rd ? rvc_i(OP_JALR, F3_JALR, 0, rd, 0) : 0;
+                }
+                return rvc_r(OP_OP, 0, F3_ADD_SUB, rd, 0, rs2); // C.MV
+            }
+            if (!rs2) {
+                if (!rd) { // C.EBREAK
+                    return rvc_i(OP_SYSTEM, F3_PRIV, 0, 0, F12_EBREAK);
+                }
+                return rvc_i(OP_JALR, F3_JALR, 1, rd, 0); // C.JALR
+            }
+            return rvc_r(OP_OP, 0, F3_ADD_SUB, rd, rd, rs2); // C.ADD
+        case 026: // C.SWSP
+            uimm = (BITS(parcel, 12, 9) << 2) | (BITS(parcel, 8, 7) << 6);
+            return rvc_s(F3_WORD, 2, rs2, uimm);
+
+        default: // C.FLD, C.FLW, C.FSD, C.FSW and their SP forms, reserved
+            return 0;
+    }
+}
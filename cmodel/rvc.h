@@ -0,0 +1,9 @@
+#ifndef _rvc_h_
+#define _rvc_h_
+
+// Chapter 16 "'C' Standard Extension for Compressed Instructions"
+#define RVC_IS_COMPRESSED(parcel) (((parcel) & 3) != 3)
+
+uint32_t rvc_expand(uint16_t parcel);
+
+#endif // _rvc_h_
@@ -0,0 +1,255 @@
+#define _POSIX_C_SOURCE 200809L
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "mem.h"
+#include "dev.h"
+#include "replay.h"
+#include "aot.h"
+#include "sim.h"
+#include "riscv.h"
+#include "rvc.h"
+#include "coverage.h"
+
+extern memword_t yarvis_step(mem_t *mem, regfile_t *regs, csrfile_t *csrs, memword_t pc);
+extern bool yarvis_fetching(void);
+
+// Captures the side effects of the instruction at `pc` that just retired,
+// then appends them to the log or checks them against it, and passes them
+// to the retirement hook. Returns false on the first divergence or when the
+// hook asks to stop.
+static bool sim_retired(sim_t *sim, memword_t pc) {
+    replay_entry_t actual = {
+        .next_pc = sim->pc,
+        .length = RVC_IS_COMPRESSED(mem_peek(sim->mem, pc, 2)) ? 2 : 4,
+        .journal = sim->journal,
+    }, expected;
+    uint64_t index = sim->retired;
+
+    sim->retired = sim->csrs.minstret;
+    sim->journal.count = 0;
+    for (unsigned int i = 1; i < NUM_REGS; i++) {
+        if ((*sim->regs)[i] != sim->shadow[i]) {
+            actual.rd = i;
+            actual.rd_value = sim->shadow[i] = (*sim->regs)[i];
+            break;
+        }
+    }
+    if (!sim->replay) {
+        // nothing to record or verify
+    } else if (!sim->verify) {
+        replay_append(sim->replay, &actual);
+    } else if (!replay_next(sim->replay, &expected)) {
+        fprintf(stderr, "Divergence at instruction %lu: log ended\n", (unsigned long)index);
+        sim->diverged = true;
+    } else if (!replay_compare(&expected, &actual, stderr)) {
+        fprintf(stderr, "Divergence at instruction %lu\n", (unsigned long)index);
+        sim->diverged = true;
+    }
+    if (sim->retire && !sim->diverged) {
+        return sim->retire(sim, pc, &actual);
+    }
+    return !sim->diverged;
+}
+
+static void sim_watch_hit(void *context, unsigned int access, memaddr_t address, memaddr_t size,
+                          memword_t data) {
+    sim_watch_t *watch = context;
+    sim_t *sim = watch->sim;
+    fprintf(stderr, "Watchpoint %s: %s %0*x at %#x, pc=%#x, instruction %llu, t=%lu\n", watch->name,
+            (access == WATCH_WRITE) ? "write" : "read", (int)size * 2, data, address, sim->pc,
+            (unsigned long long)sim->csrs.minstret, sim->time);
+    sim->stopped |= watch->stop;
+}
+
+// Logs every access of the given kinds to a range, and optionally stops
+// the run at the end of the cycle that made it.
+void sim_watch(sim_t *sim, const char *name, memaddr_t address, memaddr_t size, unsigned int access, bool stop) {
+    sim_watch_t *watch = sim->watches + sim->mem->num_watches;
+    CHECK(sim->mem->num_watches < MAX_WATCHES);
+    *watch = (sim_watch_t){ .sim = sim, .name = name, .stop = stop };
+    mem_watch(sim->mem, &(memwatch_t){
+        .address = address,
+        .size = size,
+        .access = access,
+        .hit = sim_watch_hit,
+        .context = watch,
+    });
+}
+
+// Hart 0's time is read by the other harts' threads through SYSCTL_CYCLE
+static inline void sim_advance(sim_t *sim, unsigned long cycles) {
+    __atomic_store_n(&sim->time, sim->time + cycles, __ATOMIC_RELAXED);
+}
+
+// Runs until the guest signals completion, `end` cycles have elapsed in
+// total (0 for no limit) or a retirement stops it. Returns true if it
+// stopped before `end`.
+bool sim_run(sim_t *sim, unsigned long end) {
+    mem_t *mem = sim->mem;
+    // Any hart may write the exit register, which hart 0 owns
+    const sysctl_t *sysctl = sim->primary ? &sim->primary->sysctl : &sim->sysctl;
+    for (; (end == 0) || (end > sim->time); sim_advance(sim, 1)) {
+        unsigned long cycles = 1;
+        memword_t pc = sim->pc;
+        uint64_t instret = sim->csrs.minstret;
+        if (!sim->aot || !aot_execute(sim->aot, mem, sim->regs, &sim->csrs, &sim->pc,
+                                      end ? end - sim->time : ULONG_MAX, &cycles)) {
+            if (yarvis_coverage && yarvis_fetching()) {
+                coverage_fetch(yarvis_coverage, mem, sim->regs, sim->pc);
+            }
+            sim->pc = yarvis_step(mem, sim->regs, &sim->csrs, sim->pc);
+            if (yarvis_coverage && (sim->csrs.minstret != yarvis_coverage->retired)) {
+                yarvis_coverage->retired = sim->csrs.minstret;
+                coverage_retire(yarvis_coverage, sim->regs, sim->pc);
+            }
+        }
+        sim_advance(sim, cycles - 1);
+        if (!sim->primary) {
+            clint_advance(&mem->clint, cycles);
+        }
+        if (sim->csrs.minstret != instret) {
+            sim->last_pc = pc;
+            sim->last_count = sim->csrs.minstret - instret;
+        }
+        // Updated before the retirement hook, which may stop the run and
+        // look at the state
+        bool done = (sim->tohost = mem_peek(mem, mem->symbols[SYM_TOHOST], 4))
+                    || __atomic_load_n(&sysctl->exited, __ATOMIC_ACQUIRE) || sim->stopped;
+        if ((sim->replay || sim->retire) && (sim->csrs.minstret != sim->retired) && !sim_retired(sim, pc)) {
+            sim_advance(sim, 1); // this cycle has completed, resume with the next
+            return true;
+        }
+        if (done) {
+            return true;
+        }
+        if (sim->csrs.wfi && !csr_pending(&sim->csrs, mem)) {
+            // Every cycle until the timer fires would only re-check mip,
+            // so skip straight to the cycle in which the core wakes up.
+            unsigned long skip = ULONG_MAX;
+            uint64_t mtime = clint_load(&mem->clint.mtime);
+            uint64_t mtimecmp = clint_load(&mem->clint.mtimecmp[sim->csrs.mhartid]);
+            if ((sim->csrs.mie & MIP_MTIP) && (mtimecmp > mtime)) {
+                skip = mtimecmp - mtime;
+            } else if (end == 0) {
+                fprintf(stderr, "Deadlock: WFI with no wake-up source at pc=%#x\n", sim->pc);
+                sim->stopped = true;
+                return true;
+            }
+            if (end && (skip > end - sim->time - 1)) {
+                skip = end - sim->time - 1;
+            }
+            sim_advance(sim, skip);
+            sim->idle += skip;
+            if (!sim->primary) {
+                clint_advance(&mem->clint, skip);
+            }
+        }
+    }
+    return false;
+}
+
+// Returns the pc of the last instruction to retire, or the entry point if
+// none has. A translated block retires several in one step, so the last is
+// found by walking the block's instructions from its first.
+memword_t sim_last_pc(const sim_t *sim) {
+    memword_t pc = sim->last_count ? sim->last_pc : sim->mem->entry_point;
+    for (uint64_t i = 1; i < sim->last_count; i++) {
+        pc += RVC_IS_COMPRESSED(mem_peek(sim->mem, pc, 2)) ? 2 : 4;
+    }
+    return pc;
+}
+
+typedef struct sim_group sim_group_t;
+
+typedef struct {
+    sim_group_t *group;
+    sim_t *sim;
+    pthread_t thread;
+    bool stopped; // before the end of the last quantum
+} sim_hart_t;
+
+// Harts run in parallel up to a common horizon, then wait for each other
+// at a barrier. The barrier orders all memory accesses before it against
+// all after it; between barriers only FENCE and atomics order accesses
+// across harts, as on hardware, and plain loads and stores race.
+struct sim_group {
+    sim_hart_t harts[MAX_HARTS];
+    unsigned int num_harts;
+    unsigned long end, quantum;
+    unsigned long horizon;
+    bool done;
+    bool stopped;
+    pthread_barrier_t barrier;
+};
+
+// Asleep in WFI with no interrupt that could wake it
+static bool sim_asleep(const sim_t *sim) {
+    return sim->csrs.wfi && !csr_pending(&sim->csrs, sim->mem) && !(sim->csrs.mie & MIP_MTIP);
+}
+
+// Called by one hart's thread at the end of each quantum, while the others
+// wait at the barrier.
+static void sim_group_advance(sim_group_t *group) {
+    bool asleep = true;
+    for (unsigned int i = 0; i < group->num_harts; i++) {
+        group->stopped |= group->harts[i].stopped;
+        asleep &= sim_asleep(group->harts[i].sim);
+    }
+    if (asleep && !group->stopped) {
+        fprintf(stderr, "Deadlock: every hart is in WFI with no wake-up source\n");
+        for (unsigned int i = 0; i < group->num_harts; i++) {
+            group->harts[i].sim->stopped = true;
+        }
+        group->stopped = true;
+    }
+    if (group->stopped || (group->end && (group->horizon >= group->end))) {
+        group->done = true;
+        return;
+    }
+    group->horizon += group->quantum;
+    if (group->end && (group->horizon > group->end)) {
+        group->horizon = group->end;
+    }
+}
+
+static void *sim_hart_main(void *arg) {
+    sim_hart_t *hart = arg;
+    sim_group_t *group = hart->group;
+    for (;;) {
+        pthread_barrier_wait(&group->barrier);
+        if (group->done) {
+            return NULL;
+        }
+        hart->stopped = sim_run(hart->sim, group->horizon);
+        if (pthread_barrier_wait(&group->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            sim_group_advance(group);
+        }
+    }
+}
+
+// Runs several harts sharing one memory, each on its own host thread, in
+// steps of `quantum` cycles, until the guest signals completion or `end`
+// cycles have elapsed (0 for no limit). Harts observe each other's timing
+// only to within a quantum. Returns true if they stopped before `end`.
+bool sim_run_harts(sim_t *const *harts, unsigned int num_harts, unsigned long end, unsigned long quantum) {
+    sim_group_t group = { .num_harts = num_harts, .end = end, .quantum = quantum };
+    CHECK((num_harts > 0) && (num_harts <= MAX_HARTS) && quantum);
+    group.horizon = (end && (end < harts[0]->time + quantum)) ? end : harts[0]->time + quantum;
+    CHECK(!pthread_barrier_init(&group.barrier, NULL, num_harts));
+    mem_share(harts[0]->mem, true);
+    for (unsigned int i = 0; i < num_harts; i++) {
+        group.harts[i] = (sim_hart_t){ .group = &group, .sim = harts[i] };
+        CHECK(!i || !pthread_create(&group.harts[i].thread, NULL, sim_hart_main, group.harts + i));
+    }
+    sim_hart_main(group.harts);
+    for (unsigned int i = 1; i < num_harts; i++) {
+        CHECK(!pthread_join(group.harts[i].thread, NULL));
+    }
+    pthread_barrier_destroy(&group.barrier);
+    mem_share(harts[0]->mem, false);
+    return group.stopped;
+}
@@ -0,0 +1,48 @@
+#ifndef _sim_h_
+#define _sim_h_
+
+typedef struct sim sim_t;
+
+// Called at every retirement with its side effects and the pc of the
+// retired instruction. Returning false stops sim_run().
+typedef bool sim_retire_t(sim_t *sim, memword_t pc, const replay_entry_t *entry);
+
+// Context of a watchpoint set through sim_watch()
+typedef struct {
+    sim_t *sim;
+    const char *name;
+    bool stop; // stop the run on a hit rather than only log it
+} sim_watch_t;
+
+struct sim {
+    mem_t *mem;
+    regfile_t *regs;
+    csrfile_t csrs;
+    memword_t pc;
+    memword_t tohost;
+    unsigned long time;
+    unsigned long idle;
+    sysctl_t sysctl;
+    console_t console;
+    replay_t *replay;     // record or verify architectural side effects
+    bool verify;
+    bool diverged;
+    uint64_t retired;
+    regfile_t shadow;     // register values at the previous retirement
+    memjournal_t journal; // stores since the previous retirement
+    aot_t *aot;           // translated blocks, if any
+    sim_retire_t *retire; // per-retirement hook, if any
+    void *context;        // for the hook
+    bool stopped;         // by a watchpoint or a deadlock
+    memword_t last_pc;    // where the step that last retired instructions started
+    uint64_t last_count;  // and how many it retired
+    sim_t *primary;       // hart 0, for the other harts: they share its devices and leave mtime to it
+    sim_watch_t watches[MAX_WATCHES];
+};
+
+bool sim_run(sim_t *sim, unsigned long end);
+memword_t sim_last_pc(const sim_t *sim);
+bool sim_run_harts(sim_t *const *harts, unsigned int num_harts, unsigned long end, unsigned long quantum);
+void sim_watch(sim_t *sim, const char *name, memaddr_t address, memaddr_t size, unsigned int access, bool stop);
+
+#endif // _sim_h_
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include "mem.h"
 #include "riscv.h"
+#include "rvc.h"
 
 #define ASSERT_LEGAL(condition, info) do { \
     if (!(condition)) { \
@@ -13,9 +14,38 @@
     } \
 } while(0)
 
-// Single-steps and returns the next program counter value.
-memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc) {
-    instruction_t ir = { .raw = mem_read(mem, pc, 4) };
+// Chapter 7 "M Standard Extension for Integer Multiplication and Division"
+static memword_t yarvis_muldiv(unsigned int funct3, uint32_t operand1, uint32_t operand2) {
+    int64_t signed1 = (int32_t)operand1, signed2 = (int32_t)operand2;
+    switch (funct3) {
+        case F3_MUL:
+            return operand1 * operand2;
+        case F3_MULH:
+            return (uint64_t)(signed1 * signed2) >> 32;
+        case F3_MULHSU:
+            return (uint64_t)(signed1 * (int64_t)operand2) >> 32;
+        case F3_MULHU:
+            return ((uint64_t)operand1 * operand2) >> 32;
+        // Table 7.1 "Semantics for division by zero and division overflow"
+        case F3_DIV:
+            return !operand2 ? 0xffffffff : (signed2 == -1) ? -operand1 : (uint32_t)(signed1 / signed2);
+        case F3_DIVU:
+            return !operand2 ? 0xffffffff : operand1 / operand2;
+        case F3_REM:
+            return !operand2 ? operand1 : (signed2 == -1) ? 0 : (uint32_t)(signed1 % signed2);
+        default: // F3_REMU
+            return !operand2 ? operand1 : operand1 % operand2;
+    }
+}
+
+// Executes one instruction and returns the next program counter value.
+static memword_t yarvis_execute(mem_t *mem, regfile_t *regs, csrfile_t *csrs, memword_t pc) {
+    instruction_t ir = { .raw = mem_fetch(mem, pc, &csrs->fetch_parcels) };
+    memword_t length = RVC_IS_COMPRESSED(ir.raw) ? 2 : 4;
+    if (length == 2) {
+        ir.raw = rvc_expand(ir.raw);
+        ASSERT_LEGAL(ir.raw, "illegal compressed instruction");
+    }
     base_opcode_t opcode = (ir.raw >> 2) & 0x1f;
 
     // Section 2.3 "Immediate Encoding Variants"
@@ -24,6 +54,7 @@ memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc) {
     switch (opcode) {
         // R-type
         case OP_OP:
+        case OP_AMO:
             break;
         // I-type
         case OP_OPIMM:
@@ -63,10 +94,27 @@ memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc) {
             ASSERT_LEGAL(false, "unsupported opcode");
     }
 
+#if RV32E
+    // Chapter 4 "RV32E Base Integer Instruction Set": x16-x31 are reserved.
+    // Checked once here, so reg_read() and reg_write() don't have to.
+    bool uses_rd = (opcode != OP_STORE) && (opcode != OP_BRANCH);
+    bool uses_rs1 = (opcode != OP_LUI) && (opcode != OP_AUIPC) && (opcode != OP_JAL)
+                    && !((opcode == OP_SYSTEM) && (ir.i.funct3 & 4));
+    bool uses_rs2 = (opcode == OP_OP) || (opcode == OP_AMO) || (opcode == OP_STORE) || (opcode == OP_BRANCH);
+    ASSERT_LEGAL(!(uses_rd && (ir.r.rd >= NUM_REGS))
+                 && !(uses_rs1 && (ir.r.rs1 >= NUM_REGS))
+                 && !(uses_rs2 && (ir.r.rs2 >= NUM_REGS)), "invalid register");
+#endif
+
     bool taken, altfunc;
-    memword_t addr, data, operand1, operand2, result;
+    memword_t addr, data, operand1, operand2, result, source;
     switch (opcode) {
         case OP_OP: // Section 2.4.2 "Integer Register-Register Operations"
+            if (ir.r.funct7 == F7_MULDIV) {
+                result = yarvis_muldiv(ir.r.funct3, reg_read(regs, ir.r.rs1), reg_read(regs, ir.r.rs2));
+                reg_write(regs, ir.r.rd, result);
+                break;
+            }
             switch (ir.r.funct3) {
                 case F3_ADD_SUB:
                 case F3_SRL_SRA:
@@ -128,12 +176,12 @@ memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc) {
             break;
         // Section 2.5.1 "Unconditional Jumps"
         case OP_JAL:
-            reg_write(regs, ir.j.rd, pc + 4);
+            reg_write(regs, ir.j.rd, pc + length);
             return pc + imm;
         case OP_JALR:
             ASSERT_LEGAL(ir.i.funct3 == F3_JALR, "invalid funct3");
             addr = (reg_read(regs, ir.i.rs1) + imm) & 0xfffffffe;
-            reg_write(regs, ir.i.rd, pc + 4);
+            reg_write(regs, ir.i.rd, pc + length);
             return addr;
         // Section 2.5.2 "Conditional Branches"
         case OP_BRANCH:
@@ -207,16 +255,101 @@ memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc) {
         // Section 2.7 "Memory Ordering Instructions"
         case OP_MISCMEM:
             ASSERT_LEGAL((ir.i.funct3 == F3_FENCE) || (ir.i.funct3 == F3_FENCEI), "invalid funct3");
-            // FENCE and FENCE.I are no-ops for now
+            // Orders this hart's accesses against those of harts on other
+            // threads; there is no instruction cache for FENCE.I to flush
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            break;
+        // Chapter 8 "A Standard Extension for Atomic Instructions"
+        case OP_AMO:
+            ASSERT_LEGAL(ir.r.funct3 == F3_WORD, "invalid funct3");
+            ASSERT_LEGAL(mem_amo(mem, csrs, reg_read(regs, ir.r.rs1), ir.r.funct7 >> 2,
+                                 reg_read(regs, ir.r.rs2), &data), "invalid funct5");
+            reg_write(regs, ir.r.rd, data);
             break;
-        // Section 2.8 "Environment Call and Breakpoints"
         case OP_SYSTEM:
-            ASSERT_LEGAL(ir.i.funct3 == F3_PRIV, "invalid funct3"); // Zicsr is not implemented
-            ASSERT_LEGAL((imm == F12_ECALL) || (imm == F12_EBREAK), "invalid funct12");
-            // ECALL and EBREAK are no-ops for now
+            switch (ir.i.funct3) {
+                // Section 2.8 "Environment Call and Breakpoints"
+                case F3_PRIV:
+                    switch (ir.i.imm11_0) {
+                        case F12_ECALL:
+                        case F12_EBREAK:
+                            // ECALL and EBREAK are no-ops for now
+                            break;
+                        // Section 3.3.2 "Trap-Return Instructions"
+                        case F12_MRET:
+                            return csr_mret(csrs);
+                        // Section 3.3.3 "Wait for Interrupt"
+                        case F12_WFI:
+                            csrs->wfi = !csr_pending(csrs, mem);
+                            if (csrs->wfi) {
+                                return pc;
+                            }
+                            break;
+                        default:
+                            ASSERT_LEGAL(false, "invalid funct12");
+                    }
+                    break;
+                // Chapter 9 "Zicsr", Control and Status Register (CSR) Instructions
+                case F3_CSRRW:
+                case F3_CSRRS:
+                case F3_CSRRC:
+                case F3_CSRRWI:
+                case F3_CSRRSI:
+                case F3_CSRRCI:
+                    source = (ir.i.funct3 & 4) ? ir.i.rs1 : reg_read(regs, ir.i.rs1);
+                    data = csr_read(csrs, mem, ir.i.imm11_0);
+                    if ((ir.i.funct3 & 3) == F3_CSRRW) {
+                        csr_write(csrs, ir.i.imm11_0, source);
+                    } else if (ir.i.rs1 && ((ir.i.funct3 & 3) == F3_CSRRS)) {
+                        csr_write(csrs, ir.i.imm11_0, data | source);
+                    } else if (ir.i.rs1) {
+                        csr_write(csrs, ir.i.imm11_0, data & ~source);
+                    }
+                    reg_write(regs, ir.i.rd, data);
+                    break;
+                default:
+                    ASSERT_LEGAL(false, "invalid funct3");
+            }
             break;
         default:
             ASSERT_LEGAL(false, "unreachable");
     }
-    return pc + 4;
+    return pc + length;
+}
+
+// Cycle costs used by ahead-of-time translated blocks, see aot.c
+const unsigned int yarvis_cycles_per_instruction = 1;
+const unsigned int yarvis_cycles_per_taken_branch = 0;
+
+// Multiply and divide complete in one cycle like everything else, so the
+// latencies set with -m are ignored
+unsigned int yarvis_mul_latency = 0;
+unsigned int yarvis_div_latency = 0;
+
+// Every cycle starts a new instruction
+bool yarvis_fetching(void) {
+    return true;
+}
+
+// Nothing is kept between instructions
+void yarvis_reset(void) {
+}
+
+// Single-steps and returns the next program counter value.
+memword_t yarvis_step(mem_t *mem, regfile_t *regs, csrfile_t *csrs, memword_t pc) {
+    // Section 3.1.9 "Machine Interrupt Registers (mip and mie)"
+    if ((csrs->mstatus & MSTATUS_MIE) && csr_pending(csrs, mem)) {
+        if (csrs->wfi) {
+            // A stalled WFI retires before the trap is taken
+            csrs->minstret++;
+            pc += 4;
+        }
+        return csr_trap(csrs, MCAUSE_INTERRUPT | IRQ_M_TIMER, pc);
+    }
+
+    memword_t next_pc = yarvis_execute(mem, regs, csrs, pc);
+    if (!csrs->wfi) {
+        csrs->minstret++;
+    }
+    return next_pc;
 }
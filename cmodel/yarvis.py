@@ -0,0 +1,142 @@
+"""ctypes bindings for libyarvis.so (see libyarvis.h).
+
+    with Yarvis("firmware.elf") as model:
+        for retirement in model.step(256):
+            ...
+"""
+
+import ctypes
+import os
+
+API_VERSION = 1
+NUM_REGS = 32
+MAX_STORES = 4
+
+
+class _Store(ctypes.Structure):
+    _fields_ = [("address", ctypes.c_uint32), ("size", ctypes.c_uint32), ("data", ctypes.c_uint32)]
+
+
+class Retirement(ctypes.Structure):
+    _fields_ = [
+        ("pc", ctypes.c_uint32),
+        ("next_pc", ctypes.c_uint32),
+        ("rd", ctypes.c_uint32),
+        ("rd_value", ctypes.c_uint32),
+        ("num_stores", ctypes.c_uint32),
+        ("_stores", _Store * MAX_STORES),
+        ("cycle", ctypes.c_uint64),
+    ]
+
+    @property
+    def stores(self):
+        return [(s.address, s.size, s.data) for s in self._stores[: self.num_stores]]
+
+    def __repr__(self):
+        return "Retirement(pc=%#x, next_pc=%#x, rd=x%d, rd_value=%#x, stores=%r, cycle=%d)" % (
+            self.pc, self.next_pc, self.rd, self.rd_value, self.stores, self.cycle)
+
+
+class State(ctypes.Structure):
+    _fields_ = [
+        ("pc", ctypes.c_uint32),
+        ("regs", ctypes.c_uint32 * NUM_REGS),
+        ("cycles", ctypes.c_uint64),
+        ("instret", ctypes.c_uint64),
+        ("tohost", ctypes.c_uint32),
+        ("done", ctypes.c_uint32),
+        ("status", ctypes.c_uint32),
+    ]
+
+
+def _load_library(path=None):
+    path = path or os.environ.get("LIBYARVIS") or os.path.join(os.path.dirname(os.path.abspath(__file__)), "libyarvis.so")
+    lib = ctypes.CDLL(path)
+    handle = ctypes.c_void_p
+    lib.libyarvis_api_version.restype = ctypes.c_uint
+    lib.libyarvis_load.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+    lib.libyarvis_load.restype = handle
+    lib.libyarvis_step.argtypes = [handle, ctypes.c_size_t, ctypes.POINTER(Retirement), ctypes.c_uint64]
+    lib.libyarvis_step.restype = ctypes.c_size_t
+    lib.libyarvis_read_state.argtypes = [handle, ctypes.POINTER(State)]
+    lib.libyarvis_lookup.argtypes = [handle, ctypes.c_char_p, ctypes.POINTER(ctypes.c_uint32)]
+    lib.libyarvis_lookup.restype = ctypes.c_int
+    lib.libyarvis_poke.argtypes = [handle, ctypes.c_uint32, ctypes.POINTER(ctypes.c_uint32), ctypes.c_size_t]
+    lib.libyarvis_poke.restype = ctypes.c_int
+    lib.libyarvis_peek.argtypes = [handle, ctypes.c_uint32, ctypes.POINTER(ctypes.c_uint32), ctypes.c_size_t]
+    lib.libyarvis_peek.restype = ctypes.c_int
+    lib.libyarvis_close.argtypes = [handle]
+    if lib.libyarvis_api_version() != API_VERSION:
+        raise RuntimeError("%s: API version %d, expected %d" % (path, lib.libyarvis_api_version(), API_VERSION))
+    return lib
+
+
+class Yarvis:
+    """One instance of the C model; only one can be open per process."""
+
+    def __init__(self, elf_path, console_path=None, library=None):
+        self._lib = _load_library(library)
+        self._handle = self._lib.libyarvis_load(
+            os.fsencode(elf_path), os.fsencode(console_path) if console_path else None)
+        if not self._handle:
+            raise RuntimeError("cannot load %s" % elf_path)
+        self._trace = None
+
+    def run(self, count=2**63, max_cycles=0):
+        """Retires up to `count` instructions without recording them."""
+        return self._lib.libyarvis_step(self._handle, count, None, max_cycles)
+
+    def step(self, count, max_cycles=0):
+        """Retires up to `count` instructions and returns them as a list.
+
+        The list is shorter if the guest finished or `max_cycles` elapsed.
+        """
+        if self._trace is None or len(self._trace) < count:
+            self._trace = (Retirement * count)()
+        retired = self._lib.libyarvis_step(self._handle, count, self._trace, max_cycles)
+        return [Retirement.from_buffer_copy(self._trace[i]) for i in range(retired)]
+
+    def state(self):
+        state = State()
+        self._lib.libyarvis_read_state(self._handle, ctypes.byref(state))
+        return state
+
+    @property
+    def done(self):
+        return bool(self.state().done)
+
+    def lookup(self, symbol):
+        address = ctypes.c_uint32()
+        if self._lib.libyarvis_lookup(self._handle, symbol.encode(), ctypes.byref(address)):
+            raise KeyError(symbol)
+        return address.value
+
+    def _address(self, address):
+        return self.lookup(address) if isinstance(address, str) else address
+
+    def poke(self, address, words):
+        address = self._address(address)
+        buffer = (ctypes.c_uint32 * len(words))(*words)
+        if self._lib.libyarvis_poke(self._handle, address, buffer, len(words)):
+            raise ValueError("cannot poke %d words at %#x" % (len(words), address))
+
+    def peek(self, address, count=1):
+        address = self._address(address)
+        buffer = (ctypes.c_uint32 * count)()
+        if self._lib.libyarvis_peek(self._handle, address, buffer, count):
+            raise ValueError("cannot peek %d words at %#x" % (count, address))
+        return list(buffer)
+
+    def close(self):
+        if self._handle:
+            self._lib.libyarvis_close(self._handle)
+            self._handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def __del__(self):
+        self.close()
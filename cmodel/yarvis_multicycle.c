@@ -2,8 +2,18 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "mem.h"
 #include "riscv.h"
+#include "rvc.h"
+#include "activity.h"
+#include "coverage.h"
+
+#if ACTIVITY
+#define ACTIVITY_COUNT(call) do { if (yarvis_activity) { call; } } while (0)
+#else
+#define ACTIVITY_COUNT(call) do { } while (0)
+#endif
 
 memword_t yarvis_imm_extend(instruction_t ir) {
     bool imm_sign = ir.raw & (1 << 31);
@@ -40,6 +50,20 @@ memword_t yarvis_imm_extend(instruction_t ir) {
     }
 }
 
+// Chapter 4 "RV32E Base Integer Instruction Set": x16-x31 are reserved.
+// Checked once at decode, with CHECK() so that NDEBUG builds keep it, and so
+// reg_read() and reg_write() don't have to.
+bool yarvis_regs_legal(instruction_t ir) {
+    bool uses_rd = (ir.r.opcode != OP_STORE) && (ir.r.opcode != OP_BRANCH);
+    bool uses_rs1 = (ir.r.opcode != OP_LUI) && (ir.r.opcode != OP_AUIPC) && (ir.r.opcode != OP_JAL)
+                    && !((ir.r.opcode == OP_SYSTEM) && (ir.r.funct3 & 4));
+    bool uses_rs2 = (ir.r.opcode == OP_OP) || (ir.r.opcode == OP_AMO) || (ir.r.opcode == OP_STORE)
+                    || (ir.r.opcode == OP_BRANCH);
+    return !(uses_rd && (ir.r.rd >= NUM_REGS))
+           && !(uses_rs1 && (ir.r.rs1 >= NUM_REGS))
+           && !(uses_rs2 && (ir.r.rs2 >= NUM_REGS));
+}
+
 memword_t yarvis_alu(
     memword_t operand1,
     memword_t operand2,
@@ -102,23 +126,141 @@ memword_t yarvis_alu(
     }
 }
 
-memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc) {
-    static enum {
-        ST_IFETCH,
-        ST_DECODE,
-        ST_EXECUTE,
-        ST_BRANCH,
-        NUM_STATES,
-    } state = ST_IFETCH;
-    static instruction_t ir;
-    static memword_t operand1, operand2, mem_data;
-
-    memword_t pcPlus4 = pc + 4;
-    memword_t result = yarvis_alu(operand1, operand2, ir.r.funct3,
-                                  ir.r.opcode == OP_BRANCH && state != ST_BRANCH,
-                                  ir.r.opcode == OP_OP,
-                                  ir.r.opcode == OP_OPIMM,
-                                  ir.r.funct7 & 0x20);
+// High half of the unsigned 2*XLEN-bit product, built from XLEN/2-bit limbs
+static memword_t yarvis_mulhu(memword_t operand1, memword_t operand2) {
+    const unsigned int half = XLEN / 2;
+    const memword_t mask = ((memword_t)1 << half) - 1;
+    memword_t low = (operand1 & mask) * (operand2 & mask);
+    memword_t middle1 = (operand1 >> half) * (operand2 & mask) + (low >> half);
+    memword_t middle2 = (operand1 & mask) * (operand2 >> half) + (middle1 & mask);
+    return (operand1 >> half) * (operand2 >> half) + (middle1 >> half) + (middle2 >> half);
+}
+
+// Chapter 7 "M Standard Extension for Integer Multiplication and Division"
+memword_t yarvis_muldiv(memword_t operand1, memword_t operand2, unsigned int funct3) {
+    const memword_t sign = (memword_t)1 << (XLEN - 1);
+    bool overflow = (operand1 == sign) && (operand2 == (memword_t)-1);
+    switch (funct3) {
+        case F3_MUL:
+            return operand1 * operand2;
+        case F3_MULH:
+            return yarvis_mulhu(operand1, operand2) - ((operand1 & sign) ? operand2 : 0)
+                   - ((operand2 & sign) ? operand1 : 0);
+        case F3_MULHSU:
+            return yarvis_mulhu(operand1, operand2) - ((operand1 & sign) ? operand2 : 0);
+        case F3_MULHU:
+            return yarvis_mulhu(operand1, operand2);
+        // Table 7.1 "Semantics for division by zero and division overflow"
+        case F3_DIV:
+            if (!operand2 || overflow) {
+                return !operand2 ? (memword_t)-1 : operand1;
+            }
+            return (smemword_t)operand1 / (smemword_t)operand2;
+        case F3_DIVU:
+            return !operand2 ? (memword_t)-1 : operand1 / operand2;
+        case F3_REM:
+            if (!operand2 || overflow) {
+                return !operand2 ? operand1 : 0;
+            }
+            return (smemword_t)operand1 % (smemword_t)operand2;
+        case F3_REMU:
+            return !operand2 ? operand1 : operand1 % operand2;
+        default: // unreachable
+            assert(false);
+    }
+}
+
+memword_t yarvis_csr(
+    csrfile_t *csrs,
+    const mem_t *mem,
+    unsigned int csr,
+    unsigned int funct3,
+    memword_t source,
+    bool isWrite
+) {
+    memword_t old = csr_read(csrs, mem, csr);
+    switch (funct3) {
+        case F3_CSRRW:
+        case F3_CSRRWI:
+            csr_write(csrs, csr, source);
+            break;
+        case F3_CSRRS:
+        case F3_CSRRSI:
+            if (isWrite) {
+                csr_write(csrs, csr, old | source);
+            }
+            break;
+        case F3_CSRRC:
+        case F3_CSRRCI:
+            if (isWrite) {
+                csr_write(csrs, csr, old & ~source);
+            }
+            break;
+        default: // illegal instruction
+            assert(false);
+    }
+    return old;
+}
+
+// The FSM state and datapath registers belong to one hart, and each hart
+// is stepped by its own host thread.
+static _Thread_local enum {
+    ST_IFETCH,
+    ST_DECODE,
+    ST_EXECUTE,
+    ST_BRANCH,
+    ST_MULDIV,
+    NUM_STATES,
+} state = ST_IFETCH;
+static _Thread_local instruction_t ir;
+static _Thread_local memword_t operand1, operand2, mem_data;
+static _Thread_local unsigned int length; // of the instruction in bytes, 2 if compressed
+static _Thread_local unsigned int countdown; // cycles left in ST_MULDIV
+
+const char *const yarvis_state_names[NUM_STATES] = {
+    [ST_IFETCH] = "IFETCH",
+    [ST_DECODE] = "DECODE",
+    [ST_EXECUTE] = "EXECUTE",
+    [ST_BRANCH] = "BRANCH",
+    [ST_MULDIV] = "MULDIV",
+};
+const unsigned int yarvis_num_states = NUM_STATES;
+_Static_assert(NUM_STATES <= COVERAGE_MAX_STATES, "too many states for the coverage map");
+
+// Cycle costs used by ahead-of-time translated blocks, see aot.c
+const unsigned int yarvis_cycles_per_instruction = 3;
+const unsigned int yarvis_cycles_per_taken_branch = 1;
+
+// Cycles spent in ST_MULDIV by the iterative multiplier and divider, set
+// with -m. The defaults are for radix-2 units retiring one bit per cycle;
+// 0 models single-cycle combinational units.
+unsigned int yarvis_mul_latency = XLEN;
+unsigned int yarvis_div_latency = XLEN;
+
+// True between instructions, when the next cycle fetches from the pc
+bool yarvis_fetching(void) {
+    return state == ST_IFETCH;
+}
+
+// Abandons an instruction in flight, e.g. one that was stopped part-way
+// at a cycle limit, so that the next cycle fetches.
+void yarvis_reset(void) {
+    state = ST_IFETCH;
+    ir.raw = 0;
+    operand1 = operand2 = mem_data = 0;
+    length = 0;
+    countdown = 0;
+}
+
+static memword_t yarvis_cycle(mem_t *mem, regfile_t *regs, csrfile_t *csrs, memword_t pc) {
+    memword_t pcNext = pc + length;
+    bool isMulDiv = (ir.r.opcode == OP_OP) && (ir.r.funct7 == F7_MULDIV);
+    memword_t result = isMulDiv ? yarvis_muldiv(operand1, operand2, ir.r.funct3)
+                                : yarvis_alu(operand1, operand2, ir.r.funct3,
+                                             ir.r.opcode == OP_BRANCH && state != ST_BRANCH,
+                                             ir.r.opcode == OP_OP,
+                                             ir.r.opcode == OP_OPIMM,
+                                             ir.r.funct7 & 0x20);
     unsigned int mem_size;
     switch (ir.r.funct3) {
         case F3_BYTE:
@@ -136,17 +278,31 @@ memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc) {
             assert(ir.r.opcode != OP_LOAD && ir.r.opcode != OP_STORE);
             break;
     }
+    ACTIVITY_COUNT(activity_cycle(yarvis_activity, state, pc, ir.raw, operand1, operand2, result));
 
     switch (state) {
         case ST_IFETCH:
-            ir.raw = mem_read(mem, pc, 4);
+            if ((csrs->mstatus & MSTATUS_MIE) && csr_pending(csrs, mem)) {
+                return csr_trap(csrs, MCAUSE_INTERRUPT | IRQ_M_TIMER, pc);
+            }
+            ir.raw = mem_fetch(mem, pc, &csrs->fetch_parcels);
+            ACTIVITY_COUNT(activity_bus(yarvis_activity, pc, ir.raw));
+            length = RVC_IS_COMPRESSED(ir.raw) ? 2 : 4;
+            if (length == 2) {
+                ir.raw = rvc_expand(ir.raw); // 0 if illegal
+            }
             state = ST_DECODE;
             return pc;
         case ST_DECODE:
+            CHECK(yarvis_regs_legal(ir));
             switch (ir.r.opcode) {
                 case OP_LUI:
                     operand1 = 0;
                     break;
+                case OP_SYSTEM:
+                    // CSRR*I take a zero-extended immediate in place of rs1
+                    operand1 = (ir.r.funct3 & 4) ? ir.r.rs1 : reg_read(regs, ir.r.rs1);
+                    break;
                 case OP_AUIPC:
                 case OP_JAL:
                     operand1 = pc;
@@ -157,6 +313,7 @@ memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc) {
             }
             switch (ir.r.opcode) {
                 case OP_OP:
+                case OP_AMO:
                 case OP_BRANCH:
                     operand2 = reg_read(regs, ir.r.rs2);
                     break;
@@ -167,17 +324,24 @@ memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc) {
             state = ST_EXECUTE;
             return pc;
         case ST_EXECUTE:
+            countdown = (ir.r.funct3 & 4) ? yarvis_div_latency : yarvis_mul_latency;
+            if (isMulDiv && countdown) {
+                state = ST_MULDIV;
+                return pc;
+            }
             switch (ir.r.opcode) {
                 case OP_OP:
                 case OP_OPIMM:
                 case OP_LUI:
                 case OP_AUIPC:
+                    ACTIVITY_COUNT(activity_regfile(yarvis_activity, ir.r.rd, result));
                     reg_write(regs, ir.r.rd, result);
                     state = ST_IFETCH;
-                    return pcPlus4;
+                    return pcNext;
                 case OP_JAL:
                 case OP_JALR:
-                    reg_write(regs, ir.r.rd, pcPlus4);
+                    ACTIVITY_COUNT(activity_regfile(yarvis_activity, ir.r.rd, pcNext));
+                    reg_write(regs, ir.r.rd, pcNext);
                     state = ST_IFETCH;
                     return result & ~(1UL);
                 case OP_BRANCH:
@@ -188,34 +352,100 @@ memword_t yarvis_step(mem_t *mem, regfile_t *regs, memword_t pc) {
                         return pc;
                     } else {
                         state = ST_IFETCH;
-                        return pcPlus4;
+                        return pcNext;
                     }
                 case OP_LOAD:
                     mem_data = mem_read(mem, result, mem_size);
+                    ACTIVITY_COUNT(activity_bus(yarvis_activity, result, mem_data));
                     if (ir.r.funct3 == F3_BYTE && (mem_data & (1 << 7))) {
                         mem_data |= (-1UL) << 8;
                     }
                     if (ir.r.funct3 == F3_HWORD && (mem_data & (1 << 15))) {
                         mem_data |= (-1UL) << 16;
                     }
+                    ACTIVITY_COUNT(activity_regfile(yarvis_activity, ir.r.rd, mem_data));
                     reg_write(regs, ir.r.rd, mem_data);
                     state = ST_IFETCH;
-                    return pcPlus4;
+                    return pcNext;
                 case OP_STORE:
+                    ACTIVITY_COUNT(activity_bus(yarvis_activity, result, reg_read(regs, ir.r.rs2)));
                     mem_write(mem, result, mem_size, reg_read(regs, ir.r.rs2));
                     state = ST_IFETCH;
-                    return pcPlus4;
+                    return pcNext;
                 case OP_MISCMEM:
+                    // FENCE orders this hart against harts on other threads
+                    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                    state = ST_IFETCH;
+                    return pcNext;
+                case OP_AMO:
+                    // Chapter 8 "A Standard Extension for Atomic Instructions"
+                    if ((ir.r.funct3 != F3_WORD) || !mem_amo(mem, csrs, operand1, ir.r.funct7 >> 2, operand2, &mem_data)) {
+                        assert(false); // illegal instruction
+                    }
+                    ACTIVITY_COUNT(activity_bus(yarvis_activity, operand1, mem_data));
+                    ACTIVITY_COUNT(activity_regfile(yarvis_activity, ir.r.rd, mem_data));
+                    reg_write(regs, ir.r.rd, mem_data);
+                    state = ST_IFETCH;
+                    return pcNext;
                 case OP_SYSTEM:
+                    if (ir.i.funct3 != F3_PRIV) {
+                        memword_t old = yarvis_csr(csrs, mem, ir.i.imm11_0, ir.i.funct3,
+                                                   operand1, ir.r.rs1 != 0);
+                        ACTIVITY_COUNT(activity_regfile(yarvis_activity, ir.r.rd, old));
+                        reg_write(regs, ir.r.rd, old);
+                        state = ST_IFETCH;
+                        return pcNext;
+                    }
+                    switch (ir.i.imm11_0) {
+                        case F12_ECALL:
+                        case F12_EBREAK:
+                            break; // no-ops for now
+                        case F12_MRET:
+                            state = ST_IFETCH;
+                            return csr_mret(csrs);
+                        case F12_WFI:
+                            // Stall in this state until an interrupt is pending
+                            csrs->wfi = !csr_pending(csrs, mem);
+                            if (csrs->wfi) {
+                                return pc;
+                            }
+                            break;
+                        default: // illegal instruction
+                            assert(false);
+                    }
                     state = ST_IFETCH;
-                    return pcPlus4;
+                    return pcNext;
                 default: // illegal instruction
                     assert(false);
             }
         case ST_BRANCH:
             state = ST_IFETCH;
             return result;
+        case ST_MULDIV:
+            if (--countdown) {
+                return pc;
+            }
+            ACTIVITY_COUNT(activity_regfile(yarvis_activity, ir.r.rd, result));
+            reg_write(regs, ir.r.rd, result);
+            state = ST_IFETCH;
+            return pcNext;
         default: // invalid state
             assert(false);
     }
 }
+
+// Advances the FSM by one clock cycle and returns the next program counter
+// value. An instruction retires when the FSM returns to ST_IFETCH.
+memword_t yarvis_step(mem_t *mem, regfile_t *regs, csrfile_t *csrs, memword_t pc) {
+    bool busy = (state != ST_IFETCH);
+    unsigned int from = state;
+    pc = yarvis_cycle(mem, regs, csrs, pc);
+    if (yarvis_coverage) {
+        coverage_transition(yarvis_coverage, from, state);
+    }
+    if (busy && (state == ST_IFETCH)) {
+        ACTIVITY_COUNT(activity_retire(yarvis_activity));
+        csrs->minstret++;
+    }
+    return pc;
+}
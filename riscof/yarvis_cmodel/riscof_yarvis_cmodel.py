@@ -94,6 +94,8 @@ class yarvis_cmodel(pluginTemplate):
           self.isa += 'i'
       if "M" in ispec["ISA"]:
           self.isa += 'm'
+      if "A" in ispec["ISA"]:
+          self.isa += 'a'
       if "F" in ispec["ISA"]:
           self.isa += 'f'
       if "D" in ispec["ISA"]:
@@ -1,9 +1,18 @@
 # SPDX-FileCopyrightText: © 2024 Tiny Tapeout
 # SPDX-License-Identifier: MIT
 
+import os
+
 import cocotb
 from cocotb.clock import Clock
-from cocotb.triggers import ClockCycles
+from cocotb.triggers import ClockCycles, RisingEdge
+
+# Firmware for the golden-model comparison; see test_golden_model()
+YARVIS_ELF = os.environ.get("YARVIS_ELF")
+YARVIS_MAX_CYCLES = int(os.environ.get("YARVIS_MAX_CYCLES", 1000000))
+BATCH_SIZE = 256
+RETIRE_SIGNALS = ("retire_valid", "retire_pc", "retire_rd", "retire_rd_value")
+STORE_SIGNALS = ("store_valid", "store_address", "store_size", "store_data")
 
 
 @cocotb.test()
@@ -38,3 +47,85 @@ async def test_project(dut):
 
     # Keep testing the module by changing the input values, waiting for
     # one or more clock cycles, and asserting the expected output values.
+
+
+class Scoreboard:
+    """Checks the core's retirements against the C model (libyarvis.so).
+
+    The model is stepped a batch at a time so that the Python/C boundary is
+    crossed once per BATCH_SIZE retirements rather than every cycle.
+    """
+
+    def __init__(self, model):
+        self.model = model
+        self.expected = []
+        self.checked = 0
+        # The model reports the register an instruction changed, so writes
+        # that leave a register as it was count as no write
+        self.regs = list(model.state().regs)
+        self.stores = []
+        self.done = False
+        self.refill()
+
+    def refill(self):
+        """Steps the model for the next batch, ahead of the core."""
+        batch = self.model.step(BATCH_SIZE)
+        self.expected = batch[::-1]
+        # Only a short batch can be the last, so done costs no call otherwise
+        self.done = len(batch) < BATCH_SIZE and self.model.done
+
+    def store(self, address, size, data):
+        """Records a store, to be checked with the next retirement."""
+        self.stores.append((address, size, data & ((1 << (8 * size)) - 1)))
+
+    def check(self, pc, rd, rd_value):
+        assert self.expected, "core retired pc=%#x after the model finished" % pc
+        want = self.expected.pop()
+        if not self.expected and not self.done:
+            self.refill()
+        where = "retirement %d, pc=%#x" % (self.checked, want.pc)
+        assert pc == want.pc, "%s: core retired pc=%#x" % (where, pc)
+        if rd == 0 or self.regs[rd] == rd_value:
+            rd, rd_value = 0, 0
+        self.regs[rd] = rd_value
+        assert (rd, rd_value) == (want.rd, want.rd_value), \
+            "%s: core wrote x%d=%#x, model x%d=%#x" % (where, rd, rd_value, want.rd, want.rd_value)
+        assert self.stores == want.stores, \
+            "%s: core stored %r, model %r" % (where, self.stores, want.stores)
+        self.stores = []
+        self.checked += 1
+
+
+@cocotb.test(skip=not YARVIS_ELF)
+async def test_golden_model(dut):
+    from yarvis import Yarvis
+
+    core = dut.user_project
+    if not all(hasattr(core, name) for name in RETIRE_SIGNALS + STORE_SIGNALS):
+        dut._log.warning("core has no retire_* and store_* signals yet, nothing to compare")
+        return
+
+    clock = Clock(dut.clk, 10, units="us")
+    cocotb.start_soon(clock.start())
+    dut.ena.value = 1
+    dut.ui_in.value = 0
+    dut.uio_in.value = 0
+    dut.rst_n.value = 0
+    await ClockCycles(dut.clk, 10)
+    dut.rst_n.value = 1
+
+    with Yarvis(YARVIS_ELF) as model:
+        scoreboard = Scoreboard(model)
+        for _ in range(YARVIS_MAX_CYCLES):
+            if scoreboard.done and not scoreboard.expected:
+                break
+            await RisingEdge(dut.clk)
+            if core.store_valid.value:
+                scoreboard.store(core.store_address.value.integer, core.store_size.value.integer,
+                                 core.store_data.value.integer)
+            if core.retire_valid.value:
+                scoreboard.check(core.retire_pc.value.integer, core.retire_rd.value.integer,
+                                 core.retire_rd_value.value.integer)
+        assert scoreboard.done and not scoreboard.expected, \
+            "no end after %d cycles and %d retirements" % (YARVIS_MAX_CYCLES, scoreboard.checked)
+        dut._log.info("%d retirements match the model" % scoreboard.checked)
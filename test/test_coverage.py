@@ -0,0 +1,104 @@
+# Tests the coverage map tool cmodel/coverage.py on synthetic maps:
+#
+#   pytest test_coverage.py
+
+import importlib.util
+import os
+
+import pytest
+
+# Loaded by path, as "coverage" is also the name of a common package
+_path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "cmodel", "coverage.py")
+_spec = importlib.util.spec_from_file_location("yarvis_coverage", _path)
+coverage = importlib.util.module_from_spec(_spec)
+_spec.loader.exec_module(coverage)
+
+MAP_SIZE = coverage.NUM_CLASSES + coverage.NUM_COMPRESSED + coverage.NUM_TRANSITIONS
+
+
+def bitmap(*points, size=8):
+    data = bytearray(size)
+    for point in points:
+        data[point // 8] |= 1 << (point % 8)
+    return bytes(data)
+
+
+def write(path, data):
+    path.write_bytes(coverage.HEADER.pack(coverage.MAGIC, coverage.VERSION, len(data)) + data)
+    return str(path)
+
+
+def test_points():
+    assert coverage.points(bitmap()) == set()
+    assert coverage.points(bitmap(0, 9, 63)) == {0, 9, 63}
+
+
+def test_merge():
+    assert coverage.merge([bitmap(1, 2), bitmap(2, 40), bitmap()]) == bitmap(1, 2, 40)
+    with pytest.raises(SystemExit):
+        coverage.merge([bitmap(1), bitmap(1, size=16)])
+
+
+def test_minimize_prunes_the_greedy_choice():
+    # Greedy takes the largest run first, but the two it then needs for 5
+    # and 6 cover everything it did
+    covered = {"large": {1, 2, 3, 4}, "left": {1, 2, 5}, "right": {3, 4, 6}, "subset": {1, 5}}
+    assert coverage.minimize(covered) == ["left", "right"]
+
+
+def test_minimize_keeps_every_point():
+    covered = {
+        "a": {0, 1, 2, 3, 4, 5, 6, 7},
+        "b": {0, 8},
+        "c": {1, 9},
+        "d": {8, 9},
+        "e": {7},
+        "f": {10},
+    }
+    chosen = coverage.minimize(covered)
+    assert set().union(*(covered[name] for name in chosen)) == set().union(*covered.values())
+    assert len(chosen) == len(set(chosen)) == 3
+    for name in chosen:
+        others = set().union(*(covered[other] for other in chosen if other != name))
+        assert not covered[name] <= others
+
+
+def test_minimize_single_and_duplicate_runs():
+    assert coverage.minimize({"only": {3}}) == ["only"]
+    assert len(coverage.minimize({"first": {1, 2}, "second": {1, 2}})) == 1
+
+
+def test_load_rejects_bad_maps(tmp_path):
+    good = write(tmp_path / "good.cov", bitmap(3))
+    assert coverage.load(good) == bitmap(3)
+    bad = tmp_path / "bad.cov"
+    bad.write_bytes(open(good, "rb").read()[:-1])
+    with pytest.raises(SystemExit):
+        coverage.load(str(bad))
+
+
+def test_merge_command(tmp_path):
+    runs = [write(tmp_path / f"{i}.cov", bitmap(i, 10 + i)) for i in range(3)]
+    merged = str(tmp_path / "merged.cov")
+    coverage.main(["coverage.py", "merge", merged] + runs)
+    assert coverage.load(merged) == bitmap(0, 1, 2, 10, 11, 12)
+
+
+def test_minimize_command(tmp_path, capsys):
+    runs = {name: write(tmp_path / f"{name}.cov", bitmap(*points))
+            for name, points in [("large", (1, 2, 3, 4)), ("left", (1, 2, 5)), ("right", (3, 4, 6))]}
+    coverage.main(["coverage.py", "minimize"] + list(runs.values()))
+    out, err = capsys.readouterr()
+    assert out.split() == [runs["left"], runs["right"]]
+    assert "2 of 3 runs cover all 6 points" in err
+
+
+def test_report(capsys):
+    # OP-IMM with funct3=0 (ADDI), executed with a zero result
+    opimm = 4 << 10
+    data = bytearray(MAP_SIZE)
+    data[opimm] = 1 | 1 << 5
+    coverage.report(bytes(data))
+    out = capsys.readouterr().out
+    assert out.startswith("2 points: 1 instruction classes")
+    assert "OP-IMM   funct3=0 funct7=0x00  result=0" in out
@@ -0,0 +1,100 @@
+# Tests the C model's Python bindings without the RTL:
+#
+#   make -C ../cmodel lib
+#   PYTHONPATH=../cmodel pytest test_yarvis.py
+#
+# yarvis_sum.elf adds the two words at `input` and stores the sum to `output`:
+#
+#   80000000  la   a0, input
+#   80000008  lw   a1, 0(a0)
+#   8000000c  lw   a2, 4(a0)
+#   80000010  add  a3, a1, a2
+#   80000014  la   a4, output
+#   8000001c  sw   a3, 0(a4)
+#   80000020  addi a1, a1, 0
+#   80000024  li   t6, 1
+#   8000002c  la   t5, tohost
+#   80000034  sw   t6, 0(t5)
+#   80000038  j    80000038
+
+import os
+
+import pytest
+
+from yarvis import Yarvis
+
+ELF = os.path.join(os.path.dirname(os.path.abspath(__file__)), "yarvis_sum.elf")
+
+
+@pytest.fixture
+def model():
+    with Yarvis(ELF) as model:
+        yield model
+
+
+def test_load(model):
+    state = model.state()
+    assert state.pc == 0x80000000
+    assert not any(state.regs)
+    assert (state.instret, state.tohost, state.done) == (0, 0, 0)
+    assert model.peek("input", 2) == [2, 3]
+    with pytest.raises(KeyError):
+        model.lookup("no_such_symbol")
+
+
+def test_step(model):
+    model.poke("input", [40, 2])
+    trace = model.step(100)
+    assert len(trace) == 14
+    assert [retirement.pc for retirement in trace[:3]] == [0x80000000, 0x80000004, 0x80000008]
+    assert all(retirement.next_pc == retirement.pc + 4 for retirement in trace)
+    assert (trace[4].pc, trace[4].rd, trace[4].rd_value, trace[4].stores) == (0x80000010, 13, 42, [])
+    assert (trace[7].rd, trace[7].stores) == (0, [(model.lookup("output"), 4, 42)])
+    # addi a1, a1, 0 leaves a1 as it was, so it changes no register
+    assert (trace[8].pc, trace[8].rd) == (0x80000020, 0)
+    assert trace[-1].stores == [(model.lookup("tohost"), 4, 1)]
+    assert all(a.cycle < b.cycle for a, b in zip(trace, trace[1:]))
+
+    assert model.done
+    assert model.step(100) == []
+    assert model.peek("output") == [42]
+    state = model.state()
+    assert (state.regs[13], state.instret, state.tohost) == (42, 14, 1)
+
+
+def test_step_in_batches(model):
+    trace = []
+    while not model.done:
+        batch = model.step(3)
+        assert batch and len(batch) <= 3
+        trace += batch
+    assert len(trace) == 14
+    assert model.peek("output") == [5]
+
+
+def test_max_cycles(model):
+    trace = model.step(100, max_cycles=10)
+    assert 0 < len(trace) < 14 and trace[-1].cycle <= 10
+    assert not model.done
+    assert model.run() == 14 - len(trace)
+    assert model.done
+
+
+def test_reload_after_max_cycles():
+    # Stops part-way through an instruction, which must not keep the next
+    # instance from loading or leak into it
+    with Yarvis(ELF) as model:
+        model.step(100, max_cycles=10)
+    with Yarvis(ELF) as model:
+        assert len(model.step(100)) == 14
+        assert model.peek("output") == [5]
+
+
+def test_unmapped(model):
+    with pytest.raises(ValueError):
+        model.peek(0)
+    with pytest.raises(ValueError):
+        model.poke(0x80000002, [1])
+    with pytest.raises(ValueError):
+        model.peek(0xfffffffc, 2)
+    assert model.peek("input", 2) == [2, 3]